@@ -12,15 +12,17 @@
 #include <eosio.system/native.hpp>
 
 #include <deque>
+#include <limits>
 #include <optional>
 #include <string>
 #include <type_traits>
 
 // run cicd/build.sh with `--build-type Debug` option to enable enhanced logging
+// usage: ADD_DEBUG_TRACE(debug_level::info, "event"_n[, arg0[, arg1]]), arguments are int64_t
 #ifdef DEBUG_MODE
-# define ADD_DEBUG_LOG_MSG(msg) do { _dlogs.data.push_back(std::string(__func__) + ":" + std::to_string(__LINE__) + ": " + (msg)); } while (0)
+# define ADD_DEBUG_TRACE(level, event, ...) do { add_debug_trace( (level), (event), __LINE__, ##__VA_ARGS__ ); } while (0)
 #else
-# define ADD_DEBUG_LOG_MSG(msg) do {} while (0)
+# define ADD_DEBUG_TRACE(level, event, ...) do {} while (0)
 #endif // DEBUG_MODE
 
 
@@ -32,6 +34,7 @@ namespace eosiosystem {
    using eosio::const_mem_fun;
    using eosio::datastream;
    using eosio::indexed_by;
+   using eosio::microseconds;
    using eosio::name;
    using eosio::same_payer;
    using eosio::symbol;
@@ -73,7 +76,13 @@ namespace eosiosystem {
    static constexpr int64_t  ram_gift_bytes        = 1400;
    /// per vote reward is payed to the claimrewards action caller only if this reward is greater or equal to this value
    static constexpr int64_t  min_pervote_daily_pay = 100'0000;
+   static constexpr int64_t  votepay_share_scale   = 1ll << 16;           ///< fixed point scale of votepay shares and their change rates
    static constexpr uint32_t refund_delay_sec      = 14 * seconds_per_day; ///< DAO: stake lock up period = 2 weeks
+   static constexpr uint32_t max_refunds_per_block = 10;                   ///< matured refunds processed by a single `onblock`
+   static constexpr uint32_t max_name_closes_per_block = 10;               ///< name auctions closed by a single `onblock`
+   static constexpr uint32_t max_proxy_chain_length = 2;                   ///< voter and its proxy, proxies cannot use a proxy
+   static constexpr int64_t  reward_fill_interval  = useconds_per_hour;    ///< `onblock` accrues producer pay and DAO inflation at most this often
+   static constexpr uint32_t ram_increase_interval = 120;                  ///< blocks between RAM supply increases made by `onblock`
 
    static constexpr int64_t  min_producer_activated_stake = 0;   ///< minimum activated stake
 
@@ -91,6 +100,7 @@ namespace eosiosystem {
    // - a `high_bidder` account name that is the one with the highest bid so far
    // - the `high_bid` which is amount of highest bid
    // - and `last_bid_time` which is the time of the highest bid
+   // Open auctions are ordered by `last_bid_time` in `bidtime` index, closed ones go after them.
    struct [[eosio::table, eosio::contract("eosio.system")]] name_bid {
      name       newname;
      name       high_bidder;
@@ -99,9 +109,13 @@ namespace eosiosystem {
 
      uint64_t primary_key() const { return newname.value;                    }
      uint64_t by_high_bid() const { return static_cast<uint64_t>(-high_bid); }
+     uint64_t by_bid_time() const {
+        return high_bid > 0 ? static_cast<uint64_t>(last_bid_time.time_since_epoch().count()) : std::numeric_limits<uint64_t>::max();
+     }
    };
    typedef eosio::multi_index< "namebids"_n, name_bid,
-                               indexed_by<"highbid"_n, const_mem_fun<name_bid, uint64_t, &name_bid::by_high_bid>  >
+                               indexed_by<"highbid"_n, const_mem_fun<name_bid, uint64_t, &name_bid::by_high_bid>  >,
+                               indexed_by<"bidtime"_n, const_mem_fun<name_bid, uint64_t, &name_bid::by_bid_time>  >
                              > name_bid_table;
 
    // Bid refund table
@@ -122,8 +136,8 @@ namespace eosiosystem {
       int64_t         total_ram_stake = 0;                    ///< currently total staked RAM (asset)
 
       block_timestamp last_producer_schedule_update;          ///< for cyclic schedule updates
-      time_point      last_pervote_bucket_fill;               ///< used to count reward inflation; @see system_contract::claimrewards
-      /// tokens amount sent to vpay account (reward for votes) in claimrewards action, excluding reward payed to caller
+      time_point      last_pervote_bucket_fill;               ///< used to count reward inflation; @see system_contract::fill_reward_buckets
+      /// tokens amount accrued for vpay account (reward for votes) by `onblock`, excluding reward payed to claimrewards callers
       int64_t         pervote_bucket = 0;
       int64_t         perblock_bucket = 0;                    ///< reward for unpaid blocks payed to the claimrewards caller
       uint32_t        total_unpaid_blocks = 0;                ///< all blocks which have been produced but not paid
@@ -161,7 +175,7 @@ namespace eosiosystem {
       uint16_t          new_ram_per_block = 0;
       block_timestamp   last_ram_increase;
       block_timestamp   last_block_num;                   ///< @deprecated
-      double            total_producer_votepay_share = 0;
+      double            total_producer_votepay_share = 0; ///< @deprecated see eosio_global_state5::total_votepay_share
       uint8_t           revision = 0;                     ///< used to track version updates in the future.
 
       EOSLIB_SERIALIZE( eosio_global_state2, (new_ram_per_block)(last_ram_increase)(last_block_num)
@@ -173,7 +187,7 @@ namespace eosiosystem {
    struct [[eosio::table("global3"), eosio::contract("eosio.system")]] eosio_global_state3 {
       eosio_global_state3() { }
       time_point        last_vpay_state_update;
-      double            total_vpay_share_change_rate = 0;
+      double            total_vpay_share_change_rate = 0; ///< @deprecated see eosio_global_state5::total_vpay_share_change_rate
 
       EOSLIB_SERIALIZE( eosio_global_state3, (last_vpay_state_update)(total_vpay_share_change_rate) )
    };
@@ -195,6 +209,52 @@ namespace eosiosystem {
    };
    typedef eosio::singleton< "global4"_n, eosio_global_state4 > global_state4_singleton;
 
+   /// Additional fields to eosio_global_state4.
+   struct [[eosio::table("global5"), eosio::contract("eosio.system")]] eosio_global_state5 {
+      eosio_global_state5() {}
+
+      bool               candidates_synced = false;   ///< whether `schedcands` table reflects all registered producers
+      eosio::checksum256 last_proposed_schedule_hash; ///< sha256 of the last proposed producers (with locations)
+      bool               name_bids_indexed = false;   ///< whether all name bids have `bidtime` index entries
+      symbol             core_symbol;                 ///< core symbol, stored by `init`
+      asset              core_supply;                 ///< core token supply with unissued rewards, refreshed by every reward fill of `onblock`
+      uint32_t           vote_weight_week = 0;        ///< week since block timestamp epoch of `vote_weight_multiplier`
+      double             vote_weight_multiplier = 0;  ///< stake to vote weight multiplier of `vote_weight_week`
+      bool               producers_merged = false;    ///< whether `producers2` table rows are all moved to the producers table
+      bool               voters_upgraded = false;     ///< whether all voters rows are compact and have `byproxy` index entries
+      double             activated_share = 0;         ///< `active_stake / core_supply`, updated whenever either changes
+      int32_t            activated_share_percent = 0; ///< integer percent of `active_stake` in `core_supply`
+      double             emission_rate = 0;           ///< yearly emission rate of the last reward fill
+      double             continuous_rate = 0;         ///< per-hour compounded rate of `emission_rate`
+      bool               votepay_fixed_point = false; ///< whether the votepay totals below replace the global2 and global3 ones
+      int128_t           total_votepay_share = 0;     ///< sum of producers votepay shares, scaled by `votepay_share_scale`
+      int128_t           total_vpay_share_change_rate = 0; ///< votes accruing votepay share, scaled by `votepay_share_scale`
+      bool               schedule_candidates_changed = true; ///< whether `schedcands` changed since the last proposed schedule
+      uint32_t           last_proposed_target_size = 0;      ///< target schedule size of the last proposed schedule
+      int64_t            unissued_dao = 0;            ///< accrued DAO inflation to be issued to `eosio.saving`
+      int64_t            unissued_perblock = 0;       ///< accrued per-block bucket inflation to be issued to `eosio.bpay`
+      int64_t            unissued_pervote = 0;        ///< accrued per-vote bucket inflation to be issued to `eosio.vpay`
+
+      EOSLIB_SERIALIZE( eosio_global_state5, (candidates_synced)(last_proposed_schedule_hash)
+                                             (name_bids_indexed)(core_symbol)(core_supply)
+                                             (vote_weight_week)(vote_weight_multiplier)(producers_merged)
+                                             (voters_upgraded)(activated_share)(activated_share_percent)
+                                             (emission_rate)(continuous_rate)(votepay_fixed_point)
+                                             (total_votepay_share)(total_vpay_share_change_rate)
+                                             (schedule_candidates_changed)(last_proposed_target_size)
+                                             (unissued_dao)(unissued_perblock)(unissued_pervote) )
+   };
+   typedef eosio::singleton< "global5"_n, eosio_global_state5 > global_state5_singleton;
+
+   /// Progress of the table migration run by `migrate` action.
+   struct [[eosio::table("migration"), eosio::contract("eosio.system")]] migration_state {
+      name     current;     ///< migration in progress, empty if none
+      uint64_t cursor = 0;  ///< primary key of the next row to be processed
+
+      EOSLIB_SERIALIZE( migration_state, (current)(cursor) )
+   };
+   typedef eosio::singleton< "migration"_n, migration_state > migration_singleton;
+
    /// Block producer information, stored in `producer_info` (since v1.0).
    struct [[eosio::table, eosio::contract("eosio.system")]] producer_info {
       name              owner;
@@ -206,19 +266,25 @@ namespace eosiosystem {
       time_point        last_claim_time;
       uint16_t          location = 0;
 
+      /// Fields moved from `producer_info2` (see `mergeprods` migration), absent until moved or if the producer never had them.
+      /// The vote seconds of `votepay_share` are scaled by `votepay_share_scale`.
+      eosio::binary_extension<int128_t>   votepay_share;
+      eosio::binary_extension<time_point> last_votepay_share_update;
+
       uint64_t primary_key() const { return owner.value;                             }
       double   by_votes() const    { return is_active ? -total_votes : total_votes;  }
       bool     active() const      { return is_active;                               }
       void     deactivate()        { producer_key = public_key(); is_active = false; }
 
       EOSLIB_SERIALIZE( producer_info, (owner)(total_votes)(producer_key)(is_active)(url)
-                        (unpaid_blocks)(last_claim_time)(location) )
+                        (unpaid_blocks)(last_claim_time)(location)(votepay_share)(last_votepay_share_update) )
    };
    typedef eosio::multi_index< "producers"_n, producer_info,
                                indexed_by<"prototalvote"_n, const_mem_fun<producer_info, double, &producer_info::by_votes>  >
                              > producers_table;
 
    /// Additional fields to producer_info structure (since v1.3.0).
+   /// @deprecated rows are moved to the producers table, see `mergeprods` migration
    struct [[eosio::table, eosio::contract("eosio.system")]] producer_info2 {
       name       owner;
       double     votepay_share = 0;
@@ -230,11 +296,33 @@ namespace eosiosystem {
    };
    typedef eosio::multi_index< "producers2"_n, producer_info2 > producers_table2;
 
+   /// Producer which is eligible for the producers schedule: it is active, has positive votes and
+   /// has staked at least min_producer_activated_stake tokens.
+   /// The table is updated incrementally on every change of producer votes, keys or stake,
+   /// so `update_elected_producers` just takes its top rows.
+   struct [[eosio::table, eosio::contract("eosio.system")]] schedule_candidate {
+      name              owner;
+      double            total_votes = 0;
+      eosio::public_key producer_key;
+      uint16_t          location = 0;
+      int64_t           total_staked = 0;  ///< net, cpu and vote stake of the producer account, tracked if `min_producer_activated_stake` is positive
+
+      uint64_t primary_key() const { return owner.value; }
+      double   by_votes() const    { return -total_votes; }
+
+      EOSLIB_SERIALIZE( schedule_candidate, (owner)(total_votes)(producer_key)(location)(total_staked) )
+   };
+   typedef eosio::multi_index< "schedcands"_n, schedule_candidate,
+                               indexed_by<"candvotes"_n, const_mem_fun<schedule_candidate, double, &schedule_candidate::by_votes>  >
+                             > schedule_candidates_table;
+
    /// Voter information.
+   /// Rows are compact: fields after `flags1` are only present in rows stored by a contract version before
+   /// the compact encoding, they are dropped when the row is upgraded, see `packvoters` migration.
    struct [[eosio::table, eosio::contract("eosio.system")]] voter_info {
       name              owner;                  ///< voter account name
       name              proxy;                  ///< proxy set by the voter, if any
-      std::vector<name> producers;              ///< producers approved by this voter if no proxy set
+      std::vector<name> producers;              ///< producers approved by this voter if no proxy set, one at most
       int64_t           staked = 0;             ///< amount staked
       /// Every time a vote is cast we must first "undo" the last vote weight, before casting the
       /// new vote weight. Vote weight is calculated as:
@@ -245,11 +333,11 @@ namespace eosiosystem {
       bool              is_proxy = 0;           ///< whether the voter is a proxy for others
 
       uint32_t          flags1 = 0;
-      uint32_t          reserved2 = 0;
-      eosio::asset      reserved3;
 
       uint64_t primary_key()const { return owner.value; }
       bool is_active() const { return producers.size() || proxy; }
+      bool is_compact() const { return !reserved2.has_value(); }
+      uint128_t by_proxy() const { return (uint128_t(proxy.value) << 64) | owner.value; }
 
       enum class flags1_fields : uint32_t {
          ram_managed = 1,
@@ -257,11 +345,15 @@ namespace eosiosystem {
          cpu_managed = 4
       };
 
-      eosio::binary_extension<bool> has_voted;  ///< @deprecated since merging with eosio.contracts-1.8.3
+      eosio::binary_extension<uint32_t>     reserved2; ///< @deprecated present in rows that are not upgraded yet
+      eosio::binary_extension<eosio::asset> reserved3; ///< @deprecated present in rows that are not upgraded yet
+      eosio::binary_extension<bool>         has_voted; ///< @deprecated since merging with eosio.contracts-1.8.3
 
       EOSLIB_SERIALIZE( voter_info, (owner)(proxy)(producers)(staked)(last_vote_weight)(proxied_vote_weight)(is_proxy)(flags1)(reserved2)(reserved3)(has_voted) )
    };
-   typedef eosio::multi_index< "voters"_n, voter_info > voters_table;
+   typedef eosio::multi_index< "voters"_n, voter_info,
+                               indexed_by<"byproxy"_n, const_mem_fun<voter_info, uint128_t, &voter_info::by_proxy>>
+                             > voters_table;
 
    /// Contracts version table.
    struct [[eosio::table("version"), eosio::contract("eosio.system")]] version_info {
@@ -321,17 +413,151 @@ namespace eosiosystem {
    };
    typedef eosio::multi_index< "refunds"_n, refund_request > refunds_table;
 
+   /// Refund requests ordered by request time, constructed in the scope of the system contract.
+   /// Matured requests of accounts without contract code are paid by `onblock`, see `max_refunds_per_block`.
+   struct [[eosio::table, eosio::contract("eosio.system")]] refund_queue_item {
+      name            owner;
+      time_point_sec  request_time;
+
+      uint64_t primary_key() const { return owner.value; }
+      uint64_t by_request_time() const { return request_time.utc_seconds; }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( refund_queue_item, (owner)(request_time) )
+   };
+   typedef eosio::multi_index< "refundq"_n, refund_queue_item,
+                               indexed_by<"byreqtime"_n, const_mem_fun<refund_queue_item, uint64_t, &refund_queue_item::by_request_time>>
+                             > refund_queue_table;
+
+   /// Progress of `recountproxy` action for a proxy, constructed in the scope of the system contract.
+   struct [[eosio::table, eosio::contract("eosio.system")]] proxy_recount {
+      name   proxy;
+      name   cursor;                         ///< next delegator to be counted
+      double proxied_vote_weight = 0;        ///< vote weight of the delegators counted so far
+      double last_proxied_vote_weight = 0;   ///< proxied vote weight of the proxy when the previous batch ended
+
+      uint64_t primary_key() const { return proxy.value; }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( proxy_recount, (proxy)(cursor)(proxied_vote_weight)(last_proxied_vote_weight) )
+   };
+   typedef eosio::multi_index< "proxyrecount"_n, proxy_recount > proxy_recount_table;
+
+   /// Single stake and vote request of `stakevote` action.
+   struct stake_vote_request {
+      name              receiver;
+      asset             stake_net_quantity;
+      asset             stake_cpu_quantity;
+      asset             stake_vote_quantity;
+      std::vector<name> producers;           ///< producers `receiver` votes for, no voting if empty
+
+      EOSLIB_SERIALIZE( stake_vote_request, (receiver)(stake_net_quantity)(stake_cpu_quantity)(stake_vote_quantity)(producers) )
+   };
+
+   /// Single stake change of `changebwmany` action, negative quantities are unstaked.
+   struct bandwidth_delta {
+      name  receiver;
+      asset net_delta;
+      asset cpu_delta;
+      asset vote_delta;
+
+      EOSLIB_SERIALIZE( bandwidth_delta, (receiver)(net_delta)(cpu_delta)(vote_delta) )
+   };
+
+   /// Single RAM purchase of `buyrambatch` action.
+   struct ram_purchase {
+      name  receiver;
+      asset quant;     ///< tokens to buy RAM with, fee included
+
+      EOSLIB_SERIALIZE( ram_purchase, (receiver)(quant) )
+   };
+
 
 #ifdef DEBUG_MODE
+   static constexpr uint32_t max_debug_traces = 256; ///< size of `dtrace` ring buffer
+
+   enum class debug_level : uint8_t {
+      none    = 0,
+      info    = 1,
+      verbose = 2
+   };
+
    /// Some actions (like onblock) do not allow to print anything, so we use this table for debugging.
-   struct [[eosio::table, eosio::contract("eosio.system")]] dlogs {
-      std::vector<std::string> data; // array of log messages
+   /// The table is a ring buffer: record `seq` is stored in the row `seq % max_debug_traces`.
+   struct [[eosio::table, eosio::contract("eosio.system")]] debug_trace {
+      uint64_t seq   = 0; ///< sequence number of the record
+      uint8_t  level = 0;
+      uint32_t line  = 0; ///< source line the record is added at
+      name     event;
+      int64_t  arg0  = 0;
+      int64_t  arg1  = 0;
+
+      uint64_t primary_key() const { return seq % max_debug_traces; }
+
+      EOSLIB_SERIALIZE( debug_trace, (seq)(level)(line)(event)(arg0)(arg1) )
+   };
+   typedef eosio::multi_index< "dtrace"_n, debug_trace > debug_trace_table;
+
+   struct [[eosio::table("dtracestate"), eosio::contract("eosio.system")]] debug_trace_state {
+      uint64_t next_seq = 0;                                  ///< sequence number of the next record
+      uint8_t  max_level = static_cast<uint8_t>(debug_level::info); ///< records of higher levels are skipped
 
-      EOSLIB_SERIALIZE( dlogs, (data) );
+      EOSLIB_SERIALIZE( debug_trace_state, (next_seq)(max_level) )
    };
-   typedef eosio::singleton< "dlogs"_n, dlogs > dlogs_singleton;
+   typedef eosio::singleton< "dtracestate"_n, debug_trace_state > debug_trace_state_singleton;
 #endif // DEBUG_MODE
 
+   /**
+    * Global state singleton cached for the duration of an action.
+    *
+    * The row is read on first access only, and is written back by `save()` only if it was
+    * requested for modification, so actions touching a single global do not pay for the others.
+    */
+   template<typename Singleton, typename T>
+   class lazy_global_state {
+      public:
+         using default_factory = T (*)();
+
+         lazy_global_state( name self, default_factory factory = nullptr )
+            : _singleton( self, self.value ), _self( self ), _factory( factory ) {}
+
+         const T& get() const {
+            if( !_loaded ) {
+               if( _singleton.exists() ) {
+                  _value = _singleton.get();
+               } else if( _factory ) {
+                  _value = _factory();
+               }
+               _loaded = true;
+            }
+            return _value;
+         }
+
+         const T* operator->() const { return &get(); }
+
+         /// Returns the cached state for writing, it will be stored by the next `save()`.
+         T& modify() {
+            get();
+            _dirty = true;
+            return _value;
+         }
+
+         void save() {
+            if( _dirty ) {
+               _singleton.set( _value, _self );
+               _dirty = false;
+            }
+         }
+
+      private:
+         mutable Singleton _singleton;
+         name              _self;
+         default_factory   _factory;
+         mutable T         _value;
+         mutable bool      _loaded = false;
+         bool              _dirty  = false;
+   };
+
    /**
     * The EOSIO system contract. The EOSIO system contract governs RAM market, voters, producers, global state.
     */
@@ -341,19 +567,18 @@ namespace eosiosystem {
          voters_table                _voters;
          producers_table             _producers;
          producers_table2            _producers2;
-         global_state_singleton      _global;
-         global_state2_singleton     _global2;
-         global_state3_singleton     _global3;
-         global_state4_singleton     _global4;
-         eosio_global_state          _gstate;
-         eosio_global_state2         _gstate2;
-         eosio_global_state3         _gstate3;
-         eosio_global_state4         _gstate4;
+         schedule_candidates_table   _schedule_candidates;
+         refund_queue_table          _refund_queue;
+         lazy_global_state<global_state_singleton, eosio_global_state>    _gstate;
+         lazy_global_state<global_state2_singleton, eosio_global_state2>  _gstate2;
+         lazy_global_state<global_state3_singleton, eosio_global_state3>  _gstate3;
+         lazy_global_state<global_state4_singleton, eosio_global_state4>  _gstate4;
+         lazy_global_state<global_state5_singleton, eosio_global_state5>  _gstate5;
          rammarket                   _rammarket;
          contracts_version_singleton _contracts_version;
 #ifdef DEBUG_MODE
-         dlogs                       _dlogs;
-         dlogs_singleton             _dlogs_singleton;
+         debug_trace_table           _debug_traces;
+         lazy_global_state<debug_trace_state_singleton, debug_trace_state> _debug_trace_state;
 #endif // DEBUG_MODE
 
       public:
@@ -376,8 +601,15 @@ namespace eosiosystem {
          /// Returns the core symbol by system account name
          /// @param system_account the system account to get the core symbol for.
          static symbol get_core_symbol( name system_account = "eosio"_n ) {
-            rammarket rm(system_account, system_account.value);
-            const static auto sym = get_core_symbol( rm );
+            const static auto sym = [&]() {
+               global_state5_singleton gstate5(system_account, system_account.value);
+               if( gstate5.exists() ) {
+                  const auto core = gstate5.get().core_symbol;
+                  if( core.raw() != 0 ) return core;
+               }
+               rammarket rm(system_account, system_account.value);
+               return get_core_symbol( rm );
+            }();
             return sym;
          }
 
@@ -400,10 +632,11 @@ namespace eosiosystem {
          /**
           * `onblock` action.
           * This special action is triggered when a block is applied by the given producer
-          * and cannot be generated from any other source. It is used to pay producers and calculate
-          * missed blocks of other producers. Producer pay is deposited into the producer's stake
-          * balance and can be withdrawn over time. If blocknum is the start of a new round this may
-          * update the active producer config from the producer votes.
+          * and cannot be generated from any other source. It is used to count produced blocks and,
+          * once per `reward_fill_interval`, to accrue the inflation since the previous fill to the DAO,
+          * per-block and per-vote buckets. The accrued tokens are issued by `fillrewards` and `claimrewards`,
+          * so a failing issue or transfer cannot stop `onblock`. If blocknum is the start of a new round
+          * this may update the active producer config from the producer votes.
           *
           * @param header block header produced.
           */
@@ -478,6 +711,35 @@ namespace eosiosystem {
                           const asset& stake_vote_quantity,
                           bool transfer );
 
+         /**
+          * Batched stake and vote action. Stakes SYS from the balance of `from` for the benefit of every
+          * request receiver, like `delegatebw` does, and votes for the request producers on behalf of the receiver,
+          * like `voteproducer` does. Staked tokens are moved to `eosio.stake` with a single transfer.
+          *
+          * @param from     account holding tokens to be staked,
+          * @param requests stake and vote requests, each one is validated as a `delegatebw` action,
+          * @param transfer if true, ownership of staked tokens is transfered to the receivers.
+          *
+          * @pre Authority of every receiver voting for producers is required.
+          */
+         [[eosio::action]]
+         void stakevote( const name& from, const std::vector<stake_vote_request>& requests, bool transfer );
+
+         /**
+          * Batched stake change action. Applies the stake changes of `from` for every delta receiver,
+          * like `delegatebw` and `undelegatebw` do, and nets the changes: unstaked tokens cover the tokens
+          * staked to `from` itself through the refund request of `from`, only the remainder is transfered
+          * to `eosio.stake`. Stake to other receivers is always transfered from the liquid balance.
+          *
+          * @param from   account whose tokens are staked or unstaked,
+          * @param deltas stake changes, vote can be changed only for `from` itself.
+          *
+          * @post At most one transfer to `eosio.stake` is issued.
+          * @post Pending refund of `from` is used for staking to `from` before its liquid balance.
+          */
+         [[eosio::action]]
+         void changebwmany( const name& from, const std::vector<bandwidth_delta>& deltas );
+
          /**
           * Undelegate bandwitdh action.
           * Decreases the total tokens delegated by `from` to `receiver` and/or
@@ -498,10 +760,10 @@ namespace eosiosystem {
           * @param unstake_cpu_quantity  tokens to be unstaked from CPU bandwidth,
           * @param unstake_vote_quantity tokens to be unstaked from voting,
           *
-          * @post Unstaked tokens are transferred to `from` liquid balance via a deferred transaction with a delay of 3 days.
-          * @post If called during the delay period of a previous `undelegatebw` action, pending action is canceled and timer is reset.
+          * @post Unstaked tokens are transferred to `from` liquid balance by `onblock` after the refund delay of 2 weeks.
+          * @post If called during the delay period of a previous `undelegatebw` action, timer is reset for the combined amount.
           * @post All producers `from` account has voted for will have their votes updated immediately.
-          * @post Bandwidth and storage for the deferred transaction are billed to `from`.
+          * @post Storage for the refund request is billed to `from`.
           */
          [[eosio::action]]
          void undelegatebw( name from,
@@ -522,6 +784,16 @@ namespace eosiosystem {
          [[eosio::action]]
          void buyram( const name& payer, const name& receiver, const asset& quant );
 
+         /**
+          * Batched RAM purchase action. Works as a sequence of `buyram` actions of the same payer, but updates
+          * the RAM market once and sends one inline transfer for all purchases and one for all fees.
+          *
+          * @param payer     the RAM buyer account name,
+          * @param purchases receivers and quantities of tokens to buy RAM with, applied in order.
+          */
+         [[eosio::action]]
+         void buyrambatch( const name& payer, const std::vector<ram_purchase>& purchases );
+
          /**
           * RAM bytes purchaise action. Increases receiver's RAM in quantity of bytes provided.
           * An inline transfer from receiver to system contract of tokens will be executed.
@@ -545,7 +817,8 @@ namespace eosiosystem {
 
          /**
           * Refund action. This action is called after the delegation-period to claim all pending
-          * unstaked tokens belonging to owner.
+          * unstaked tokens belonging to owner. Matured refunds of accounts without contract code are also paid
+          * automatically by `onblock`.
           *
           * @param owner owner account name of the tokens claimed.
           */
@@ -589,8 +862,8 @@ namespace eosiosystem {
 
          /**
           * Set RAM rate action. Sets the rate of increase of RAM in bytes per block. It is capped by the uint16_t to
-          * a maximum rate of 3 TB per year. If update_ram_supply hasn't been called for the most recent block,
-          * then new RAM will be allocated at the old rate up to the present block before switching the rate.
+          * a maximum rate of 3 TB per year. New RAM is added to the market by `onblock` every `ram_increase_interval` blocks,
+          * RAM allocated at the old rate up to the present block is added before switching the rate.
           *
           * @param bytes_per_block amount of bytes per block increase to set.
           */
@@ -649,12 +922,21 @@ namespace eosiosystem {
 
          /**
           * Rewards claiming action. Claim block producing and vote rewards.
+          * Rewards are paid from the buckets filled by `onblock`, inflation accrued to them and not issued yet
+          * is issued first, as by `fillrewards`.
           *
           * @param owner producer account claiming per-block and per-vote rewards.
           */
          [[eosio::action]]
          void claimrewards( const name& owner );
 
+         /**
+          * Rewards issuing action. Issues the inflation accrued by `onblock` and transfers it to `eosio.saving`,
+          * `eosio.bpay` and `eosio.vpay`. Can be called by anyone.
+          */
+         [[eosio::action]]
+         void fillrewards();
+
          /**
           * Set privilege status for an account. Allows to set privilege status for an account (turn it on/off).
           *
@@ -683,6 +965,47 @@ namespace eosiosystem {
          [[eosio::action]]
          void updtrevision( uint8_t revision );
 
+         /**
+          * Update contracts version action. Stores the version of the deployed contracts code
+          * in the `version` table, it should be pushed after setting a new code. The row is not
+          * rewritten if it already holds the current version.
+          */
+         [[eosio::action]]
+         void updtversion();
+
+         /**
+          * Table migration action. Processes up to `max_rows` rows of a migration needed after upgrading
+          * from an older contract version. The progress is stored in `migration` singleton, so a migration
+          * of any size is run by a series of calls, each fitting into transaction limits. One migration
+          * can be in progress at a time. Migrations:
+          * - `synccands` fills `schedcands` table from the producers table, until it completes producers
+          *   schedule is built from the producers table,
+          * - `reindexbids` adds name bids to `bidtime` index, until it completes only the highest bid
+          *   is closed once a day,
+          * - `mergeprods` moves `producers2` table rows to the producers table, until it completes
+          *   a producer row is completed from `producers2` table when it is touched,
+          * - `packvoters` rewrites voters to compact rows with `byproxy` index entries, until it completes
+          *   a voter is upgraded when it is touched and `recountproxy` action is not available.
+          *
+          * @param migration name of the migration,
+          * @param max_rows maximal number of rows to process in this call.
+          */
+         [[eosio::action]]
+         void migrate( const name& migration, uint16_t max_rows );
+
+         /**
+          * Proxy recount action. Recomputes proxied vote weight of `proxy` from vote weights of its delegators,
+          * found through `byproxy` index, and propagates the difference to the voted producers. Repairs drift
+          * left by vote weight changes too small to be propagated. Delegators are counted in batches of `max_rows`,
+          * the progress is stored in `proxyrecount` table. If the proxied vote weight changes between the batches,
+          * counting starts over.
+          *
+          * @param proxy the proxy to recount,
+          * @param max_rows maximal number of delegators to count in this call.
+          */
+         [[eosio::action]]
+         void recountproxy( const name& proxy, uint16_t max_rows );
+
          /**
           * Name bidding action. Allows an account `bidder` to place a bid for a name `newname`.
           * @param bidder  account placing the bid,
@@ -711,6 +1034,16 @@ namespace eosiosystem {
          [[eosio::action]]
          void bidrefund( const name& bidder, const name& newname );
 
+#ifdef DEBUG_MODE
+         /**
+          * Set debug trace level action. Records of levels higher than `max_level` are not stored in `dtrace` table.
+          *
+          * @param max_level maximal level of stored records, 0 disables tracing.
+          */
+         [[eosio::action]]
+         void setdbglevel( uint8_t max_level );
+#endif // DEBUG_MODE
+
          using init_action         = eosio::action_wrapper<"init"_n,         &system_contract::init>;
          using setacctram_action   = eosio::action_wrapper<"setacctram"_n,   &system_contract::setacctram>;
          using setacctnet_action   = eosio::action_wrapper<"setacctnet"_n,   &system_contract::setacctnet>;
@@ -718,7 +1051,10 @@ namespace eosiosystem {
          using activate_action     = eosio::action_wrapper<"activate"_n,     &system_contract::activate>;
          using delegatebw_action   = eosio::action_wrapper<"delegatebw"_n,   &system_contract::delegatebw>;
          using undelegatebw_action = eosio::action_wrapper<"undelegatebw"_n, &system_contract::undelegatebw>;
+         using stakevote_action    = eosio::action_wrapper<"stakevote"_n,    &system_contract::stakevote>;
+         using changebwmany_action = eosio::action_wrapper<"changebwmany"_n, &system_contract::changebwmany>;
          using buyram_action       = eosio::action_wrapper<"buyram"_n,       &system_contract::buyram>;
+         using buyrambatch_action  = eosio::action_wrapper<"buyrambatch"_n,  &system_contract::buyrambatch>;
          using buyrambytes_action  = eosio::action_wrapper<"buyrambytes"_n,  &system_contract::buyrambytes>;
          using sellram_action      = eosio::action_wrapper<"sellram"_n,      &system_contract::sellram>;
          using refund_action       = eosio::action_wrapper<"refund"_n,       &system_contract::refund>;
@@ -729,8 +1065,12 @@ namespace eosiosystem {
          using voteproducer_action = eosio::action_wrapper<"voteproducer"_n, &system_contract::voteproducer>;
          using regproxy_action     = eosio::action_wrapper<"regproxy"_n,     &system_contract::regproxy>;
          using claimrewards_action = eosio::action_wrapper<"claimrewards"_n, &system_contract::claimrewards>;
+         using fillrewards_action  = eosio::action_wrapper<"fillrewards"_n,  &system_contract::fillrewards>;
          using rmvproducer_action  = eosio::action_wrapper<"rmvproducer"_n,  &system_contract::rmvproducer>;
          using updtrevision_action = eosio::action_wrapper<"updtrevision"_n, &system_contract::updtrevision>;
+         using updtversion_action  = eosio::action_wrapper<"updtversion"_n,  &system_contract::updtversion>;
+         using migrate_action      = eosio::action_wrapper<"migrate"_n,      &system_contract::migrate>;
+         using recountproxy_action = eosio::action_wrapper<"recountproxy"_n, &system_contract::recountproxy>;
          using bidname_action      = eosio::action_wrapper<"bidname"_n,      &system_contract::bidname>;
          using bidrefund_action    = eosio::action_wrapper<"bidrefund"_n,    &system_contract::bidrefund>;
          using setpriv_action      = eosio::action_wrapper<"setpriv"_n,      &system_contract::setpriv>;
@@ -740,6 +1080,25 @@ namespace eosiosystem {
       private:
          // Implementation details:
 
+         /// Converts vote weight or vote seconds to the votepay fixed point, truncating toward zero.
+         static int128_t to_votepay_fixed( double value ) {
+            return static_cast<int128_t>( value * votepay_share_scale );
+         }
+
+         /**
+          * Votepay shares accumulated at `rate` (fixed point shares per second) over `elapsed`. Whole seconds
+          * and the remainder are multiplied separately, so weeks-long intervals do not overflow; the result
+          * saturates at a quarter of the int128_t range to leave room for the totals it is added to.
+          */
+         static int128_t get_votepay_share_delta( int128_t rate, const microseconds& elapsed ) {
+            constexpr int128_t max_share = int128_t(1) << 125;
+            if( rate <= 0 || elapsed.count() <= 0 ) return 0;
+            const int128_t secs = elapsed.count() / 1'000'000;
+            const int128_t rem  = elapsed.count() % 1'000'000;
+            if( rate >= max_share / (secs + 1) ) return max_share;
+            return rate * secs + rate * rem / 1'000'000;
+         }
+
          static symbol get_core_symbol( const rammarket& rm ) {
             auto itr = rm.find(ramcore_symbol.raw());
             check(itr != rm.end(), "system contract must first be initialized");
@@ -749,7 +1108,15 @@ namespace eosiosystem {
          // defined in eosio.system.cpp
          static eosio_global_state get_default_parameters();
          symbol core_symbol()const;
+         asset core_supply();
+         void set_core_supply( const asset& supply );
+         void add_active_stake( int64_t delta );
+         void update_activated_share();
          void update_ram_supply();
+         void update_contracts_version();
+#ifdef DEBUG_MODE
+         void add_debug_trace( debug_level level, name event, uint32_t line, int64_t arg0 = 0, int64_t arg1 = 0 );
+#endif // DEBUG_MODE
 
          // defined in delegate_bandwidth.cpp
          void changebw( name from, name receiver,
@@ -757,17 +1124,54 @@ namespace eosiosystem {
                         const asset& stake_cpu_quantity,
                         const asset& stake_vote_quantity,
                         bool transfer );
+         void check_delegation( const name& from, const name& receiver,
+                                const asset& stake_net_quantity,
+                                const asset& stake_cpu_quantity,
+                                const asset& stake_vote_quantity,
+                                bool transfer );
+         void update_delegated_bandwidth( const name& from, const name& receiver,
+                                          const asset& stake_net_delta,
+                                          const asset& stake_cpu_delta,
+                                          const asset& stake_vote_delta );
+         std::optional<time_point_sec> update_refund( const name& owner, asset& net_balance, asset& cpu_balance, asset& vote_balance );
+         void schedule_refund( const name& owner, const std::optional<time_point_sec>& request_time );
+         void send_refund( const refund_request& req );
+         void process_refunds( uint32_t max_refunds );
+         void transfer_stake( const name& from, const asset& quantity );
          void update_voting_power( const name& voter, const asset& total_update );
+         void add_ram_bytes( const name& receiver, int64_t bytes );
+
+         // defined in name_bidding.cpp
+         void replace_name_bid( name_bid_table& bids, name_bid_table::const_iterator itr, const name_bid& bid );
+         std::optional<uint64_t> reindex_name_bids( uint64_t cursor, uint16_t max_rows );
+         void close_name_auctions( const block_timestamp& timestamp );
+
+         // defined in producer_pay.cpp
+         void fill_reward_buckets( const time_point& ct );
+         bool issue_rewards();
 
          // defined in voting.hpp
          void update_elected_producers( const block_timestamp& timestamp );
+         double stake2vote( int64_t staked );
          void update_votes( const name& voter, const name& proxy, const std::vector<name>& producers, bool voting );
-         void propagate_weight_change( const voter_info& voter );
-         double update_producer_votepay_share( const producers_table2::const_iterator& prod_itr,
-                                               const time_point& ct,
-                                               double shares_rate, bool reset_to_zero = false );
-         double update_total_votepay_share( const time_point& ct,
-                                            double additional_shares_delta = 0.0, double shares_rate_delta = 0.0 );
+         void propagate_weight_change( const voter_info& voter, double proxied_delta = 0.0,
+                                       std::optional<bool> is_proxy = {} );
+         void apply_producers_vote_delta( const std::vector<name>& producers, double delta );
+         bool merge_producer_votepay_share( const producer_info& prod );
+         static int128_t update_producer_votepay_share( producer_info& prod,
+                                                        const time_point& ct,
+                                                        int128_t shares_rate, bool reset_to_zero = false );
+         int128_t update_total_votepay_share( const time_point& ct,
+                                              int128_t additional_shares_delta = 0, int128_t shares_rate_delta = 0 );
+         void update_schedule_candidate( const producer_info& prod, std::optional<int64_t> total_staked = {} );
+         void update_schedule_candidate_stake( const name& owner, int64_t total_staked );
+         void mark_schedule_candidates_changed();
+         std::optional<uint64_t> sync_schedule_candidates( uint64_t cursor, uint16_t max_rows );
+         std::optional<uint64_t> merge_producers( uint64_t cursor, uint16_t max_rows );
+         std::optional<uint64_t> upgrade_voters( uint64_t cursor, uint16_t max_rows );
+         voters_table::const_iterator upgrade_voter( voters_table::const_iterator itr );
+         voters_table::const_iterator find_voter( const name& owner );
+         const voter_info& get_voter( const name& owner, const char* error_msg );
 
          template <auto system_contract::*...Ptrs>
          class registration {
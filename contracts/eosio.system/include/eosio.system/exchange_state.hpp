@@ -39,6 +39,7 @@ namespace eosiosystem {
       asset convert( const asset& from, const symbol& to );
       asset direct_convert( const asset& from, const symbol& to );
 
+      /// Constant product (50/50 relay) kernels used for RAM trading, see ram_quote.hpp.
       static int64_t get_bancor_output( int64_t inp_reserve,
                                         int64_t out_reserve,
                                         int64_t inp );
@@ -141,6 +141,20 @@ namespace eosiosystem {
       EOSLIB_SERIALIZE( abi_hash, (owner)(hash) )
    };
 
+   /**
+    * code_account
+    *
+    * @details code_account is the structure underlying the codeaccts table, a row is kept for every account
+    * with contract code set by `setcode`:
+    * - `owner`: the account owner of the contract's code
+    */
+   struct [[eosio::table("codeaccts"), eosio::contract("eosio.system")]] code_account {
+      name              owner;
+      uint64_t primary_key()const { return owner.value; }
+
+      EOSLIB_SERIALIZE( code_account, (owner) )
+   };
+
    // Method parameters commented out to prevent generation of code that parses input data.
    /**
     * The EOSIO core native contract that governs authorization and contracts' abi.
@@ -291,7 +305,7 @@ namespace eosiosystem {
           * @param code - the code content to be set, in the form of a blob binary..
           */
          [[eosio::action]]
-         void setcode( const name& account, uint8_t vmtype, uint8_t vmversion, const std::vector<char>& code ) {}
+         void setcode( const name& account, uint8_t vmtype, uint8_t vmversion, const std::vector<char>& code );
 
          /** @}*/
 
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * RAM market math shared by the system contract and off-chain code.
+ *
+ * @details This header depends on nothing but the standard library, so wallets and quoting services can
+ * build it natively (see the `ram_quote` CMake target) and get exactly the numbers `buyram`, `buyrambytes`
+ * and `sellram` produce for the same `rammarket` row. Reserves are the amounts of the row's `base` (RAM bytes)
+ * and `quote` (core token) connector balances.
+ *
+ * Quotes are only defined for positive reserves, non-negative amounts and purchases strictly smaller than
+ * the output reserve. Any other arguments, and results that do not fit int64_t, give `no_quote`; callers
+ * must test for it before using the result.
+ */
+namespace eosiosystem::ram_quote {
+
+   /**
+    * @addtogroup eosiosystem
+    * @{
+    */
+
+   /// Result of a quote with arguments outside of the domain of the market math.
+   constexpr int64_t no_quote = -1;
+
+   /// 0.5% fee charged on RAM purchases and sales, rounded up.
+   inline int64_t get_fee( int64_t amount ) {
+      return ( amount + 199 ) / 200;
+   }
+
+   /**
+    * Constant product (50/50 relay) output for `inp` paid into the input reserve, rounded down.
+    * Intermediate values are 128-bit and the output is always smaller than `out_reserve`.
+    */
+   inline int64_t get_bancor_output( int64_t inp_reserve, int64_t out_reserve, int64_t inp ) {
+      if ( inp_reserve <= 0 || out_reserve <= 0 || inp < 0 ) return no_quote;
+
+      const __int128 ib = inp_reserve;
+      const __int128 ob = out_reserve;
+      const __int128 in = inp;
+
+      return int64_t( (in * ob) / (ib + in) );
+   }
+
+   /**
+    * Constant product input needed to take `out` from the output reserve, rounded down.
+    * Gives `no_quote` unless `out < out_reserve`.
+    */
+   inline int64_t get_bancor_input( int64_t out_reserve, int64_t inp_reserve, int64_t out ) {
+      if ( inp_reserve <= 0 || out_reserve <= 0 || out < 0 || out >= out_reserve ) return no_quote;
+
+      const __int128 ob = out_reserve;
+      const __int128 ib = inp_reserve;
+
+      const __int128 inp = (ib * out) / (ob - out);
+      return inp > INT64_MAX ? no_quote : int64_t( inp );
+   }
+
+   /// Bytes credited by `buyram` for `payment` core token units (fee included in `payment`).
+   inline int64_t bytes_for_payment( int64_t ram_reserve, int64_t core_reserve, int64_t payment ) {
+      if ( payment < 0 ) return no_quote;
+      return get_bancor_output( core_reserve, ram_reserve, payment - get_fee( payment ) );
+   }
+
+   /// Core token units `buyrambytes` charges for `bytes`, fee included. Gives `no_quote` unless `bytes < ram_reserve`.
+   inline int64_t payment_for_bytes( int64_t ram_reserve, int64_t core_reserve, int64_t bytes ) {
+      const int64_t cost = get_bancor_input( ram_reserve, core_reserve, bytes );
+      if ( cost == no_quote ) return no_quote;
+
+      const __int128 cost_plus_fee = __int128(cost) * 200 / 199; // cost / 0.995
+      return cost_plus_fee > INT64_MAX ? no_quote : int64_t( cost_plus_fee );
+   }
+
+   /// Core token units `sellram` leaves to the seller of `bytes`, after the fee.
+   inline int64_t proceeds_for_bytes( int64_t ram_reserve, int64_t core_reserve, int64_t bytes ) {
+      const int64_t tokens_out = get_bancor_output( ram_reserve, core_reserve, bytes );
+      if ( tokens_out == no_quote ) return no_quote;
+      return tokens_out - get_fee( tokens_out );
+   }
+
+   /** @}*/ // end of @addtogroup eosiosystem
+} /// namespace eosiosystem::ram_quote
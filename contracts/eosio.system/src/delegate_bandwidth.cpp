@@ -6,6 +6,7 @@
 #include <eosio/transaction.hpp>
 
 #include <eosio.system/eosio.system.hpp>
+#include <eosio.system/ram_quote.hpp>
 #include <eosio.token/eosio.token.hpp>
 
 #include "name_bidding.cpp"
@@ -29,8 +30,9 @@ namespace eosiosystem {
       auto itr = _rammarket.find(ramcore_symbol.raw());
       const int64_t ram_reserve   = itr->base.balance.amount;
       const int64_t eos_reserve   = itr->quote.balance.amount;
-      const int64_t cost          = exchange_state::get_bancor_input( ram_reserve, eos_reserve, bytes );
-      const int64_t cost_plus_fee = cost / double(0.995);
+      check( bytes < ram_reserve, "cannot buy the whole reserve" );
+      const int64_t cost_plus_fee = ram_quote::payment_for_bytes( ram_reserve, eos_reserve, bytes );
+      check( cost_plus_fee != ram_quote::no_quote, "invalid ram market quote" );
       buyram( payer, receiver, asset{ cost_plus_fee, core_symbol() } );
    }
 
@@ -46,13 +48,12 @@ namespace eosiosystem {
    void system_contract::buyram( const name& payer, const name& receiver, const asset& quant )
    {
       require_auth( payer );
-      update_ram_supply();
 
       check( quant.symbol == core_symbol(), "must buy ram with core token" );
       check( quant.amount > 0, "must purchase a positive amount" );
 
       auto fee = quant;
-      fee.amount = ( fee.amount + 199 ) / 200; /// .5% fee (round up)
+      fee.amount = ram_quote::get_fee( fee.amount ); /// .5% fee (round up)
       // fee.amount cannot be 0 since that is only possible if quant.amount is 0 which is not allowed by the assert above.
       // If quant.amount == 1, then fee.amount == 1,
       // otherwise if quant.amount > 1, then 0 < fee.amount < quant.amount.
@@ -78,9 +79,61 @@ namespace eosiosystem {
 
       check( bytes_out > 0, "must reserve a positive amount" );
 
-      _gstate.total_ram_bytes_reserved += uint64_t(bytes_out);
-      _gstate.total_ram_stake          += quant_after_fee.amount;
+      auto& gstate = _gstate.modify();
+      gstate.total_ram_bytes_reserved += uint64_t(bytes_out);
+      gstate.total_ram_stake          += quant_after_fee.amount;
 
+      add_ram_bytes( receiver, bytes_out );
+   }
+
+   void system_contract::buyrambatch( const name& payer, const std::vector<ram_purchase>& purchases )
+   {
+      require_auth( payer );
+      check( !purchases.empty(), "no ram purchases" );
+
+      asset total_after_fee( 0, core_symbol() );
+      asset total_fee( 0, core_symbol() );
+      std::vector<int64_t> bytes_out;
+      bytes_out.reserve( purchases.size() );
+
+      // purchases are converted one after another, so each receiver gets the same bytes as from `buyram`
+      const auto& market = _rammarket.get(ramcore_symbol.raw(), "ram market does not exist");
+      _rammarket.modify( market, same_payer, [&]( auto& es ) {
+         for( const auto& p : purchases ) {
+            check( p.quant.symbol == core_symbol(), "must buy ram with core token" );
+            check( p.quant.amount > 0, "must purchase a positive amount" );
+
+            auto quant_after_fee = p.quant;
+            quant_after_fee.amount -= ram_quote::get_fee( p.quant.amount ); /// .5% fee (round up)
+
+            const int64_t bytes = es.direct_convert( quant_after_fee, ram_symbol ).amount;
+            check( bytes > 0, "must reserve a positive amount" );
+            bytes_out.push_back( bytes );
+
+            total_after_fee += quant_after_fee;
+            total_fee       += p.quant - quant_after_fee;
+         }
+      });
+
+      {
+         token::transfer_action transfer_act{ token_account, { {payer, active_permission}, {ram_account, active_permission} } };
+         transfer_act.send( payer, ram_account, total_after_fee, "buy ram" );
+      }
+      {
+         token::transfer_action transfer_act{ token_account, { {payer, active_permission} } };
+         transfer_act.send( payer, ramfee_account, total_fee, "ram fee" );
+      }
+
+      auto& gstate = _gstate.modify();
+      gstate.total_ram_stake += total_after_fee.amount;
+      for( size_t i = 0; i < purchases.size(); ++i ) {
+         gstate.total_ram_bytes_reserved += uint64_t(bytes_out[i]);
+         add_ram_bytes( purchases[i].receiver, bytes_out[i] );
+      }
+   }
+
+   void system_contract::add_ram_bytes( const name& receiver, int64_t bytes )
+   {
       user_resources_table userres( get_self(), receiver.value );
       auto res_itr = userres.find( receiver.value );
       if( res_itr == userres.end() ) {
@@ -89,15 +142,15 @@ namespace eosiosystem {
                res.net_weight = asset( 0, core_symbol() );
                res.cpu_weight = asset( 0, core_symbol() );
                res.vote_weight = asset( 0, core_symbol() );
-               res.ram_bytes = bytes_out;
+               res.ram_bytes = bytes;
             });
       } else {
          userres.modify( res_itr, receiver, [&]( auto& res ) {
-               res.ram_bytes += bytes_out;
+               res.ram_bytes += bytes;
             });
       }
 
-      auto voter_itr = _voters.find( res_itr->owner.value );
+      auto voter_itr = find_voter( res_itr->owner );
       if( voter_itr == _voters.end() || !has_field( voter_itr->flags1, voter_info::flags1_fields::ram_managed ) ) {
          int64_t ram_bytes, net, cpu;
          get_resource_limits( res_itr->owner, ram_bytes, net, cpu );
@@ -113,7 +166,6 @@ namespace eosiosystem {
     */
    void system_contract::sellram( const name& account, int64_t bytes ) {
       require_auth( account );
-      update_ram_supply();
 
       check( bytes > 0, "cannot sell negative byte" );
 
@@ -131,17 +183,18 @@ namespace eosiosystem {
 
       check( tokens_out.amount > 1, "token amount received from selling ram is too low" );
 
-      _gstate.total_ram_bytes_reserved -= static_cast<decltype(_gstate.total_ram_bytes_reserved)>(bytes); // bytes > 0 is asserted above
-      _gstate.total_ram_stake          -= tokens_out.amount;
+      auto& gstate = _gstate.modify();
+      gstate.total_ram_bytes_reserved -= static_cast<decltype(gstate.total_ram_bytes_reserved)>(bytes); // bytes > 0 is asserted above
+      gstate.total_ram_stake          -= tokens_out.amount;
 
       //// this shouldn't happen, but just in case it does we should prevent it
-      check( _gstate.total_ram_stake >= 0, "error, attempt to unstake more tokens than previously staked" );
+      check( _gstate->total_ram_stake >= 0, "error, attempt to unstake more tokens than previously staked" );
 
       userres.modify( res_itr, account, [&]( auto& res ) {
           res.ram_bytes -= bytes;
       });
 
-      auto voter_itr = _voters.find( res_itr->owner.value );
+      auto voter_itr = find_voter( res_itr->owner );
       if( voter_itr == _voters.end() || !has_field( voter_itr->flags1, voter_info::flags1_fields::ram_managed ) ) {
          int64_t ram_bytes, net, cpu;
          get_resource_limits( res_itr->owner, ram_bytes, net, cpu );
@@ -152,7 +205,7 @@ namespace eosiosystem {
          token::transfer_action transfer_act{ token_account, { {ram_account, active_permission}, {account, active_permission} } };
          transfer_act.send( ram_account, account, asset(tokens_out), "sell ram" );
       }
-      auto fee = ( tokens_out.amount + 199 ) / 200; /// .5% fee (round up)
+      auto fee = ram_quote::get_fee( tokens_out.amount ); /// .5% fee (round up)
       // since tokens_out.amount was asserted to be at least 2 earlier, fee.amount < tokens_out.amount
       if ( fee > 0 ) {
          token::transfer_action transfer_act{ token_account, { {account, active_permission} } };
@@ -168,13 +221,7 @@ namespace eosiosystem {
       check( max_claimable - claimable <= stake, "b1 can only claim their tokens over 10 years" );
    }
 
-   void system_contract::changebw( name from, name receiver,
-                                   const asset& stake_net_delta,
-                                   const asset& stake_cpu_delta,
-                                   const asset& stake_vote_delta,
-                                   bool transfer )
-   {
-      require_auth( from );
+   void check_stake_deltas( const asset& stake_net_delta, const asset& stake_cpu_delta, const asset& stake_vote_delta ) {
       check( stake_net_delta.amount != 0 || stake_cpu_delta.amount != 0 || stake_vote_delta.amount != 0, "should stake non-zero amount" );
       ///@{
       ///DAO
@@ -186,12 +233,50 @@ namespace eosiosystem {
             check_asset_sign(stake_cpu_delta, stake_vote_delta) &&
             check_asset_sign(stake_net_delta, stake_vote_delta), "net, cpu and, vote deltas should not have opposite signs");
       ///@}
+   }
+
+   void system_contract::changebw( name from, name receiver,
+                                   const asset& stake_net_delta,
+                                   const asset& stake_cpu_delta,
+                                   const asset& stake_vote_delta,
+                                   bool transfer )
+   {
+      require_auth( from );
+      check_stake_deltas( stake_net_delta, stake_cpu_delta, stake_vote_delta );
 
       name source_stake_from = from;
       if ( transfer ) {
          from = receiver;
       }
 
+      update_delegated_bandwidth( from, receiver, stake_net_delta, stake_cpu_delta, stake_vote_delta );
+
+      // create refund or update from existing refund
+      if ( stake_account != source_stake_from ) { //for eosio both transfer and refund make no sense
+         auto net_balance = stake_net_delta;
+         auto cpu_balance = stake_cpu_delta;
+         auto vote_balance = stake_vote_delta;
+
+         // net and cpu are same sign by assertions in delegatebw and undelegatebw
+         // redundant assertion also at start of changebw to protect against misuse of changebw
+         bool is_undelegating = (net_balance.amount + cpu_balance.amount + vote_balance.amount) < 0;
+         bool is_delegating_to_self = (!transfer && from == receiver);
+
+         if( is_delegating_to_self || is_undelegating ) {
+            schedule_refund( from, update_refund( from, net_balance, cpu_balance, vote_balance ) );
+         }
+         transfer_stake( source_stake_from, net_balance + cpu_balance + vote_balance );
+      }
+
+      // voting power is determinted by staked vote
+      update_voting_power( from, stake_vote_delta);
+   }
+
+   void system_contract::update_delegated_bandwidth( const name& from, const name& receiver,
+                                                     const asset& stake_net_delta,
+                                                     const asset& stake_cpu_delta,
+                                                     const asset& stake_vote_delta )
+   {
       // update stake delegated from "from" to "receiver"
       {
          del_bandwidth_table del_tbl( get_self(), from.value );
@@ -243,12 +328,16 @@ namespace eosiosystem {
          check( 0 <= tot_itr->cpu_weight.amount, "insufficient staked total cpu bandwidth" );
          check( 0 <= tot_itr->vote_weight.amount, "insufficient staked total  vote bandwidth" );
 
+         if constexpr ( min_producer_activated_stake > 0 ) {
+            update_schedule_candidate_stake( receiver, tot_itr->net_weight.amount + tot_itr->cpu_weight.amount + tot_itr->vote_weight.amount );
+         }
+
          {
             bool ram_managed = false;
             bool net_managed = false;
             bool cpu_managed = false;
 
-            auto voter_itr = _voters.find( receiver.value );
+            auto voter_itr = find_voter( receiver );
             if( voter_itr != _voters.end() ) {
                ram_managed = has_field( voter_itr->flags1, voter_info::flags1_fields::ram_managed );
                net_managed = has_field( voter_itr->flags1, voter_info::flags1_fields::net_managed );
@@ -270,117 +359,143 @@ namespace eosiosystem {
             totals_tbl.erase( tot_itr );
          }
       } // tot_itr can be invalid, should go out of scope
+   }
 
-      // create refund or update from existing refund
-      if ( stake_account != source_stake_from ) { //for eosio both transfer and refund make no sense
-         refunds_table refunds_tbl( get_self(), from.value );
-         auto req = refunds_tbl.find( from.value );
-
-         //create/update/delete refund
-         auto net_balance = stake_net_delta;
-         auto cpu_balance = stake_cpu_delta;
-         auto vote_balance = stake_vote_delta;
-         bool need_deferred_trx = false;
+   /**
+    * Moves the negative balances to the refund request of `owner` and covers the positive ones
+    * from the pending refund. Balances left positive have to be transfered to `eosio.stake`.
+    *
+    * @return request time of the refund pending after the update, if any
+    */
+   std::optional<time_point_sec> system_contract::update_refund( const name& owner, asset& net_balance, asset& cpu_balance, asset& vote_balance ) {
+      refunds_table refunds_tbl( get_self(), owner.value );
+      auto req = refunds_tbl.find( owner.value );
 
+      if ( req != refunds_tbl.end() ) { //need to update refund
+         refunds_tbl.modify( req, same_payer, [&]( refund_request& r ) {
+            if ( net_balance.amount < 0 || cpu_balance.amount < 0 || vote_balance.amount < 0) {
+               r.request_time = current_time_point();
+            }
+            r.net_amount -= net_balance;
+            if ( r.net_amount.amount < 0 ) {
+               net_balance = -r.net_amount;
+               r.net_amount.amount = 0;
+            } else {
+               net_balance.amount = 0;
+            }
+            r.cpu_amount -= cpu_balance;
+            if ( r.cpu_amount.amount < 0 ){
+               cpu_balance = -r.cpu_amount;
+               r.cpu_amount.amount = 0;
+            } else {
+               cpu_balance.amount = 0;
+            }
+            r.vote_amount -= vote_balance;
+            if ( r.vote_amount.amount < 0 ){
+               vote_balance = -r.vote_amount;
+               r.vote_amount.amount = 0;
+            } else {
+               vote_balance.amount = 0;
+            }
+         });
 
-         // net and cpu are same sign by assertions in delegatebw and undelegatebw
-         // redundant assertion also at start of changebw to protect against misuse of changebw
-         bool is_undelegating = (net_balance.amount + cpu_balance.amount + vote_balance.amount) < 0;
-         bool is_delegating_to_self = (!transfer && from == receiver);
+         check( 0 <= req->net_amount.amount, "negative net refund amount" ); //should never happen
+         check( 0 <= req->cpu_amount.amount, "negative cpu refund amount" ); //should never happen
+         check( 0 <= req->vote_amount.amount, "negative vote refund amount" ); //should never happen
 
-         if( is_delegating_to_self || is_undelegating ) {
-            if ( req != refunds_tbl.end() ) { //need to update refund
-               refunds_tbl.modify( req, same_payer, [&]( refund_request& r ) {
-                  if ( net_balance.amount < 0 || cpu_balance.amount < 0 || vote_balance.amount < 0) {
-                     r.request_time = current_time_point();
-                  }
-                  r.net_amount -= net_balance;
-                  if ( r.net_amount.amount < 0 ) {
-                     net_balance = -r.net_amount;
-                     r.net_amount.amount = 0;
-                  } else {
-                     net_balance.amount = 0;
-                  }
-                  r.cpu_amount -= cpu_balance;
-                  if ( r.cpu_amount.amount < 0 ){
-                     cpu_balance = -r.cpu_amount;
-                     r.cpu_amount.amount = 0;
-                  } else {
-                     cpu_balance.amount = 0;
-                  }
-                  r.vote_amount -= vote_balance;
-                  if ( r.vote_amount.amount < 0 ){
-                     vote_balance = -r.vote_amount;
-                     r.vote_amount.amount = 0;
-                  } else {
-                     vote_balance.amount = 0;
-                  }
-               });
+         if ( req->is_empty() ) {
+            refunds_tbl.erase( req );
+            return {};
+         }
+         return req->request_time;
+      } else if ( net_balance.amount < 0 || cpu_balance.amount < 0 || vote_balance.amount < 0) { //need to create refund
+         refunds_tbl.emplace( owner, [&]( refund_request& r ) {
+            r.owner = owner;
+            if ( net_balance.amount < 0 ) {
+               r.net_amount = -net_balance;
+               net_balance.amount = 0;
+            } else {
+               r.net_amount = asset( 0, core_symbol() );
+            }
+            if ( cpu_balance.amount < 0 ) {
+               r.cpu_amount = -cpu_balance;
+               cpu_balance.amount = 0;
+            } else {
+               r.cpu_amount = asset( 0, core_symbol() );
+            }
+            if ( vote_balance.amount < 0 ) {
+               r.vote_amount = -vote_balance;
+               vote_balance.amount = 0;
+            } else {
+               r.vote_amount = asset( 0, core_symbol() );
+            }
+            r.request_time = current_time_point();
+         });
+         return time_point_sec( current_time_point() );
+      } // else stake increase requested with no existing row in refunds_tbl -> nothing to do with refunds_tbl
+      return {};
+   }
 
-               check( 0 <= req->net_amount.amount, "negative net refund amount" ); //should never happen
-               check( 0 <= req->cpu_amount.amount, "negative cpu refund amount" ); //should never happen
-               check( 0 <= req->vote_amount.amount, "negative vote refund amount" ); //should never happen
-
-               if ( req->is_empty() ) {
-                  refunds_tbl.erase( req );
-                  need_deferred_trx = false;
-               } else {
-                  need_deferred_trx = true;
-               }
-            } else if ( net_balance.amount < 0 || cpu_balance.amount < 0 || vote_balance.amount < 0) { //need to create refund
-               refunds_tbl.emplace( from, [&]( refund_request& r ) {
-                  r.owner = from;
-                  if ( net_balance.amount < 0 ) {
-                     r.net_amount = -net_balance;
-                     net_balance.amount = 0;
-                  } else {
-                     r.net_amount = asset( 0, core_symbol() );
-                  }
-                  if ( cpu_balance.amount < 0 ) {
-                     r.cpu_amount = -cpu_balance;
-                     cpu_balance.amount = 0;
-                  } else {
-                     r.cpu_amount = asset( 0, core_symbol() );
-                  }
-                  if ( vote_balance.amount < 0 ) {
-                     r.vote_amount = -vote_balance;
-                     vote_balance.amount = 0;
-                  } else {
-                     r.vote_amount = asset( 0, core_symbol() );
-                  }
-                  r.request_time = current_time_point();
-               });
-               need_deferred_trx = true;
-            } // else stake increase requested with no existing row in refunds_tbl -> nothing to do with refunds_tbl
-         } /// end if is_delegating_to_self || is_undelegating
-
-         if ( need_deferred_trx ) {
-            eosio::transaction out;
-            out.actions.emplace_back( permission_level{from, active_permission},
-                                      get_self(), "refund"_n,
-                                      from
-            );
-            out.delay_sec = refund_delay_sec;
-            eosio::cancel_deferred( from.value ); // TODO: Remove this line when replacing deferred trxs is fixed
-            out.send( from.value, from, true );
-         } else {
-            eosio::cancel_deferred( from.value );
+   void system_contract::schedule_refund( const name& owner, const std::optional<time_point_sec>& request_time ) {
+      auto itr = _refund_queue.find( owner.value );
+      if ( !request_time ) {
+         if ( itr != _refund_queue.end() ) {
+            _refund_queue.erase( itr );
          }
+      } else if ( itr == _refund_queue.end() ) {
+         _refund_queue.emplace( owner, [&]( auto& q ) {
+            q.owner        = owner;
+            q.request_time = *request_time;
+         });
+      } else if ( itr->request_time != *request_time ) {
+         _refund_queue.modify( itr, same_payer, [&]( auto& q ) {
+            q.request_time = *request_time;
+         });
+      }
+   }
 
-         auto transfer_amount = net_balance + cpu_balance + vote_balance;
-         if ( 0 < transfer_amount.amount ) {
-            token::transfer_action transfer_act{ token_account, { {source_stake_from, active_permission} } };
-            transfer_act.send( source_stake_from, stake_account, asset(transfer_amount), "stake bandwidth" );
+   void system_contract::send_refund( const refund_request& req ) {
+      token::transfer_action transfer_act{ token_account, { {stake_account, active_permission}, {req.owner, active_permission} } };
+      transfer_act.send( stake_account, req.owner, req.net_amount + req.cpu_amount + req.vote_amount, "unstake" );
+   }
+
+   /**
+    * Matured refunds are paid inline, so only accounts without contract code are paid: their transfer
+    * notification cannot be rejected and fail `onblock`. Requests of accounts with code, set by `setcode`
+    * or having an abi set by `setabi`, are left for their owners to claim by `refund`.
+    */
+   void system_contract::process_refunds( uint32_t max_refunds ) {
+      const auto ct = current_time_point();
+      eosio::multi_index< "codeaccts"_n, code_account > code_accounts( get_self(), get_self().value );
+      eosio::multi_index< "abihash"_n, abi_hash > abi_hashes( get_self(), get_self().value );
+      auto idx = _refund_queue.get_index<"byreqtime"_n>();
+      for ( auto itr = idx.begin(); itr != idx.end() && 0 < max_refunds; --max_refunds ) {
+         if ( ct < itr->request_time + seconds(refund_delay_sec) ) {
+            break;
          }
+         const name owner = itr->owner;
+         if ( code_accounts.find( owner.value ) == code_accounts.end() && abi_hashes.find( owner.value ) == abi_hashes.end() ) {
+            refunds_table refunds_tbl( get_self(), owner.value );
+            auto req = refunds_tbl.find( owner.value );
+            if ( req != refunds_tbl.end() ) {
+               send_refund( *req );
+               refunds_tbl.erase( req );
+            }
+         }
+         itr = idx.erase( itr );
       }
+   }
 
-      // voting power is determinted by staked vote
-      update_voting_power( from, stake_vote_delta);
+   void system_contract::transfer_stake( const name& from, const asset& quantity ) {
+      if ( 0 < quantity.amount ) {
+         token::transfer_action transfer_act{ token_account, { {from, active_permission} } };
+         transfer_act.send( from, stake_account, quantity, "stake bandwidth" );
+      }
    }
 
    void system_contract::update_voting_power( const name& voter, const asset& total_update )
    {
-      auto voter_itr = _voters.find( voter.value );
+      auto voter_itr = find_voter( voter );
       if( voter_itr == _voters.end() ) {
          voter_itr = _voters.emplace( voter, [&]( auto& v ) {
             v.owner = voter;
@@ -398,7 +513,7 @@ namespace eosiosystem {
       ///DAO: decrease active_stake when revoking votes
       if( voter_itr->is_active()) {
          ///DAO: [cyb-352] active stake and max producer amount
-         _gstate.active_stake += total_update.amount;
+         add_active_stake( total_update.amount );
          update_votes( voter, voter_itr->proxy, voter_itr->producers, false );
       }
       ///@}
@@ -410,7 +525,17 @@ namespace eosiosystem {
                                      const asset& stake_vote_quantity,
                                      bool transfer )
    {
-      asset zero_asset( 0, core_symbol() );
+      check_delegation( from, receiver, stake_net_quantity, stake_cpu_quantity, stake_vote_quantity, transfer );
+      changebw( from, receiver, stake_net_quantity, stake_cpu_quantity, stake_vote_quantity, transfer);
+   } // delegatebw
+
+   void system_contract::check_delegation( const name& from, const name& receiver,
+                                           const asset& stake_net_quantity,
+                                           const asset& stake_cpu_quantity,
+                                           const asset& stake_vote_quantity,
+                                           bool transfer )
+   {
+      const asset zero_asset( 0, core_symbol() );
       check( stake_cpu_quantity >= zero_asset, "must stake a positive amount" );
       check( stake_net_quantity >= zero_asset, "must stake a positive amount" );
       check( stake_vote_quantity >= zero_asset, "must stake a positive amount" );
@@ -421,9 +546,110 @@ namespace eosiosystem {
       // vote delegation to receiver != from is disallowed because he cannot vote with it
       check( transfer || from == receiver || stake_vote_quantity == zero_asset, "vote can only be transfered or delegated to yourself");
       ///@}
+   }
 
-      changebw( from, receiver, stake_net_quantity, stake_cpu_quantity, stake_vote_quantity, transfer);
-   } // delegatebw
+   void system_contract::stakevote( const name& from, const std::vector<stake_vote_request>& requests, bool transfer ) {
+      require_auth( from );
+      check( !requests.empty(), "no stake requests" );
+
+      asset transfer_amount( 0, core_symbol() );
+      bool  refund_updated = false;
+      std::optional<time_point_sec> pending_refund;
+      for( const auto& req : requests ) {
+         check_delegation( from, req.receiver, req.stake_net_quantity, req.stake_cpu_quantity, req.stake_vote_quantity, transfer );
+
+         const name owner = transfer ? req.receiver : from;
+         update_delegated_bandwidth( owner, req.receiver, req.stake_net_quantity, req.stake_cpu_quantity, req.stake_vote_quantity );
+
+         if ( stake_account != from ) {
+            auto net_balance = req.stake_net_quantity;
+            auto cpu_balance = req.stake_cpu_quantity;
+            auto vote_balance = req.stake_vote_quantity;
+            if ( owner == req.receiver && !transfer ) { // delegating to self is covered from the pending refund first
+               pending_refund = update_refund( owner, net_balance, cpu_balance, vote_balance );
+               refund_updated = true;
+            }
+            transfer_amount += net_balance + cpu_balance + vote_balance;
+         }
+
+         update_voting_power( owner, req.stake_vote_quantity );
+         if ( !req.producers.empty() ) {
+            voteproducer( req.receiver, name(), req.producers );
+         }
+      }
+
+      if ( refund_updated ) {
+         schedule_refund( from, pending_refund );
+      }
+      transfer_stake( from, transfer_amount );
+   }
+
+   void system_contract::changebwmany( const name& from, const std::vector<bandwidth_delta>& deltas ) {
+      require_auth( from );
+      check( !deltas.empty(), "no stake changes" );
+
+      const asset zero_asset( 0, core_symbol() );
+      asset net_balance = zero_asset;     // changes covered from or added to the pending refund
+      asset cpu_balance = zero_asset;
+      asset vote_balance = zero_asset;
+      asset staked_to_others = zero_asset; // stake delegated to other accounts, transfered from the liquid balance
+      asset vote_delta = zero_asset;
+      bool is_undelegating = false;
+      for( const auto& d : deltas ) {
+         check_stake_deltas( d.net_delta, d.cpu_delta, d.vote_delta );
+         ///DAO: [cyb-462] disallow vote delegation (#21)
+         check( from == d.receiver || d.vote_delta == zero_asset, "vote can only be delegated to yourself" );
+
+         update_delegated_bandwidth( from, d.receiver, d.net_delta, d.cpu_delta, d.vote_delta );
+
+         // as in changebw, only delegating to self and undelegating go through the refund
+         const bool is_undelegating_one = (d.net_delta.amount + d.cpu_delta.amount + d.vote_delta.amount) < 0;
+         if( from == d.receiver || is_undelegating_one ) {
+            net_balance  += d.net_delta;
+            cpu_balance  += d.cpu_delta;
+            vote_balance += d.vote_delta;
+         } else {
+            staked_to_others += d.net_delta + d.cpu_delta + d.vote_delta;
+         }
+         vote_delta += d.vote_delta;
+         is_undelegating = is_undelegating || is_undelegating_one;
+      }
+      check( !is_undelegating || _gstate->thresh_activated_stake_time != time_point(),
+             "cannot undelegate bandwidth until the chain is activated (at least 15% of all tokens participate in voting)" );
+
+      // unstaked tokens go to the refund request and cover the ones staked to self, the rest is transfered once
+      if ( stake_account != from ) {
+
+         // tokens unstaked from one resource pay for another one directly
+         int64_t staked = 0, unstaked = 0;
+         for( const asset* balance : { &net_balance, &cpu_balance, &vote_balance } ) {
+            ( balance->amount < 0 ? unstaked : staked ) += std::abs( balance->amount );
+         }
+         int64_t staked_offset = std::min( staked, unstaked );
+         int64_t unstaked_offset = staked_offset;
+         for( asset* balance : { &net_balance, &cpu_balance, &vote_balance } ) {
+            if( balance->amount > 0 ) {
+               const int64_t d = std::min( balance->amount, staked_offset );
+               balance->amount -= d;
+               staked_offset   -= d;
+            } else {
+               const int64_t d = std::min( -balance->amount, unstaked_offset );
+               balance->amount += d;
+               unstaked_offset -= d;
+            }
+         }
+
+         if ( net_balance.amount != 0 || cpu_balance.amount != 0 || vote_balance.amount != 0 ) {
+            schedule_refund( from, update_refund( from, net_balance, cpu_balance, vote_balance ) );
+         }
+         transfer_stake( from, net_balance + cpu_balance + vote_balance + staked_to_others );
+      }
+
+      // voting power is determinted by staked vote
+      if ( vote_delta.amount != 0 ) {
+         update_voting_power( from, vote_delta );
+      }
+   }
 
    void system_contract::undelegatebw( name from, name receiver,
                                        const asset& unstake_net_quantity,
@@ -435,7 +661,7 @@ namespace eosiosystem {
       check( unstake_net_quantity >= zero_asset, "must unstake a positive amount" );
       check( unstake_vote_quantity >= zero_asset, "must unstake a positive amount" );
       check( unstake_cpu_quantity.amount + unstake_net_quantity.amount + unstake_vote_quantity.amount > 0, "must unstake a positive amount" );
-      check( _gstate.thresh_activated_stake_time != time_point(),
+      check( _gstate->thresh_activated_stake_time != time_point(),
              "cannot undelegate bandwidth until the chain is activated (at least 15% of all tokens participate in voting)" );
 
       changebw( from, receiver, -unstake_net_quantity, -unstake_cpu_quantity, -unstake_vote_quantity, false);
@@ -450,9 +676,9 @@ namespace eosiosystem {
       check( req != refunds_tbl.end(), "refund request not found" );
       check( req->request_time + seconds(refund_delay_sec) <= current_time_point(),
              "refund is not available yet" );
-      token::transfer_action transfer_act{ token_account, { {stake_account, active_permission}, {req->owner, active_permission} } };
-      transfer_act.send( stake_account, req->owner, req->net_amount + req->cpu_amount + req->vote_amount, "unstake" );
+      send_refund( *req );
       refunds_tbl.erase( req );
+      schedule_refund( owner, {} );
    }
 
 
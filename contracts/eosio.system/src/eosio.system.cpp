@@ -4,6 +4,7 @@
 #include <eosio/crypto.hpp>
 #include <eosio/dispatcher.hpp>
 
+#include <algorithm>
 #include <cmath>
 
 namespace eosiosystem {
@@ -16,24 +17,20 @@ namespace eosiosystem {
       , _voters(get_self(), get_self().value)
       , _producers(get_self(), get_self().value)
       , _producers2(get_self(), get_self().value)
-      , _global(get_self(), get_self().value)
-      , _global2(get_self(), get_self().value)
-      , _global3(get_self(), get_self().value)
-      , _global4(get_self(), get_self().value)
+      , _schedule_candidates(get_self(), get_self().value)
+      , _refund_queue(get_self(), get_self().value)
+      , _gstate(get_self(), &system_contract::get_default_parameters)
+      , _gstate2(get_self())
+      , _gstate3(get_self())
+      , _gstate4(get_self())
+      , _gstate5(get_self())
       , _rammarket(get_self(), get_self().value)
       , _contracts_version(get_self(), get_self().value)
 #ifdef DEBUG_MODE
-      , _dlogs_singleton(get_self(), get_self().value)
+      , _debug_traces(get_self(), get_self().value)
+      , _debug_trace_state(get_self())
 #endif
    {
-      _gstate  = _global.exists() ? _global.get() : get_default_parameters();
-      _gstate2 = _global2.exists() ? _global2.get() : eosio_global_state2{};
-      _gstate3 = _global3.exists() ? _global3.get() : eosio_global_state3{};
-      _gstate4 = _global4.exists() ? _global4.get() : eosio_global_state4{};
-      _contracts_version.set(version_info{CONTRACTS_VERSION}, get_self());
-#ifdef DEBUG_MODE
-      _dlogs = _dlogs_singleton.exists() ? _dlogs_singleton.get() : dlogs{};
-#endif
    }
 
    eosio_global_state system_contract::get_default_parameters() {
@@ -43,28 +40,60 @@ namespace eosiosystem {
    }
 
    symbol system_contract::core_symbol()const {
-      const static auto sym = get_core_symbol( _rammarket );
+      const static auto sym = ( _gstate5->core_symbol.raw() != 0 ) ? _gstate5->core_symbol : get_core_symbol( _rammarket );
       return sym;
    }
 
+   asset system_contract::core_supply() {
+      if( _gstate5->core_supply.symbol.raw() == 0 ) {
+         // contract upgraded from a version without the snapshot, read the supply once and keep it
+         const auto core = core_symbol();
+         auto& gstate5 = _gstate5.modify();
+         gstate5.core_symbol = core;
+         gstate5.core_supply = eosio::token::get_supply(token_account, core.code() );
+         update_activated_share();
+      }
+      return _gstate5->core_supply;
+   }
+
+   void system_contract::set_core_supply( const asset& supply ) {
+      if( supply.amount != core_supply().amount ) {
+         _gstate5.modify().core_supply = supply;
+         update_activated_share();
+      }
+   }
+
+   void system_contract::add_active_stake( int64_t delta ) {
+      _gstate.modify().active_stake += delta;
+      update_activated_share();
+   }
+
+   void system_contract::update_activated_share() {
+      const int64_t supply = core_supply().amount;
+      auto& gstate5 = _gstate5.modify();
+      gstate5.activated_share         = supply > 0 ? 1.0 * _gstate->active_stake / supply : 0.0;
+      gstate5.activated_share_percent = supply > 0 ? 100 * _gstate->active_stake / supply : 0;
+   }
+
    system_contract::~system_contract() {
-      _global.set( _gstate, get_self() );
-      _global2.set( _gstate2, get_self() );
-      _global3.set( _gstate3, get_self() );
-      _global4.set( _gstate4, get_self() );
+      _gstate.save();
+      _gstate2.save();
+      _gstate3.save();
+      _gstate4.save();
+      _gstate5.save();
 #ifdef DEBUG_MODE
-      _dlogs_singleton.set(_dlogs, get_self());
+      _debug_trace_state.save();
 #endif
    }
 
    void system_contract::setram( uint64_t max_ram_size ) {
       require_auth( get_self() );
 
-      check( _gstate.max_ram_size < max_ram_size, "ram may only be increased" ); /// decreasing ram might result market maker issues
+      check( _gstate->max_ram_size < max_ram_size, "ram may only be increased" ); /// decreasing ram might result market maker issues
       check( max_ram_size < 1024ll*1024*1024*1024*1024, "ram size is unrealistic" );
-      check( max_ram_size > _gstate.total_ram_bytes_reserved, "attempt to set max below reserved" );
+      check( max_ram_size > _gstate->total_ram_bytes_reserved, "attempt to set max below reserved" );
 
-      auto delta = int64_t(max_ram_size) - int64_t(_gstate.max_ram_size);
+      auto delta = int64_t(max_ram_size) - int64_t(_gstate->max_ram_size);
       auto itr = _rammarket.find(ramcore_symbol.raw());
 
       /**
@@ -74,17 +103,17 @@ namespace eosiosystem {
          m.base.balance.amount += delta;
       });
 
-      _gstate.max_ram_size = max_ram_size;
+      _gstate.modify().max_ram_size = max_ram_size;
    }
 
    void system_contract::update_ram_supply() {
       auto cbt = eosio::current_block_time();
 
-      if( cbt <= _gstate2.last_ram_increase ) return;
+      if( cbt <= _gstate2->last_ram_increase ) return;
 
       auto itr = _rammarket.find(ramcore_symbol.raw());
-      auto new_ram = (cbt.slot - _gstate2.last_ram_increase.slot)*_gstate2.new_ram_per_block;
-      _gstate.max_ram_size += new_ram;
+      auto new_ram = (cbt.slot - _gstate2->last_ram_increase.slot)*_gstate2->new_ram_per_block;
+      _gstate.modify().max_ram_size += new_ram;
 
       /**
        * Increase the amount of ram for sale based upon the change in max ram size.
@@ -92,20 +121,20 @@ namespace eosiosystem {
       _rammarket.modify( itr, same_payer, [&]( auto& m ) {
          m.base.balance.amount += new_ram;
       });
-      _gstate2.last_ram_increase = cbt;
+      _gstate2.modify().last_ram_increase = cbt;
    }
 
    void system_contract::setramrate( uint16_t bytes_per_block ) {
       require_auth( get_self() );
 
       update_ram_supply();
-      _gstate2.new_ram_per_block = bytes_per_block;
+      _gstate2.modify().new_ram_per_block = bytes_per_block;
    }
 
    void system_contract::setparams( const eosio::blockchain_parameters& params ) {
       require_auth( get_self() );
-      (eosio::blockchain_parameters&)(_gstate) = params;
-      check( 3 <= _gstate.max_authority_depth, "max_authority_depth should be at least 3" );
+      (eosio::blockchain_parameters&)(_gstate.modify()) = params;
+      check( 3 <= _gstate->max_authority_depth, "max_authority_depth should be at least 3" );
       set_blockchain_parameters( params );
    }
 
@@ -121,7 +150,7 @@ namespace eosiosystem {
       auto ritr = userres.find( account.value );
       check( ritr == userres.end(), "only supports unlimited accounts" );
 
-      auto vitr = _voters.find( account.value );
+      auto vitr = find_voter( account );
       if( vitr != _voters.end() ) {
          bool ram_managed = has_field( vitr->flags1, voter_info::flags1_fields::ram_managed );
          bool net_managed = has_field( vitr->flags1, voter_info::flags1_fields::net_managed );
@@ -141,7 +170,7 @@ namespace eosiosystem {
       int64_t ram = 0;
 
       if( !ram_bytes ) {
-         auto vitr = _voters.find( account.value );
+         auto vitr = find_voter( account );
          check( vitr != _voters.end() && has_field( vitr->flags1, voter_info::flags1_fields::ram_managed ),
                 "RAM of account is already unmanaged" );
 
@@ -159,7 +188,7 @@ namespace eosiosystem {
       } else {
          check( *ram_bytes >= 0, "not allowed to set RAM limit to unlimited" );
 
-         auto vitr = _voters.find( account.value );
+         auto vitr = find_voter( account );
          if ( vitr != _voters.end() ) {
             _voters.modify( vitr, same_payer, [&]( auto& v ) {
                v.flags1 = set_field( v.flags1, voter_info::flags1_fields::ram_managed, true );
@@ -186,7 +215,7 @@ namespace eosiosystem {
       int64_t net = 0;
 
       if( !net_weight ) {
-         auto vitr = _voters.find( account.value );
+         auto vitr = find_voter( account );
          check( vitr != _voters.end() && has_field( vitr->flags1, voter_info::flags1_fields::net_managed ),
                 "Network bandwidth of account is already unmanaged" );
 
@@ -203,7 +232,7 @@ namespace eosiosystem {
       } else {
          check( *net_weight >= -1, "invalid value for net_weight" );
 
-         auto vitr = _voters.find( account.value );
+         auto vitr = find_voter( account );
          if ( vitr != _voters.end() ) {
             _voters.modify( vitr, same_payer, [&]( auto& v ) {
                v.flags1 = set_field( v.flags1, voter_info::flags1_fields::net_managed, true );
@@ -230,7 +259,7 @@ namespace eosiosystem {
       int64_t cpu = 0;
 
       if( !cpu_weight ) {
-         auto vitr = _voters.find( account.value );
+         auto vitr = find_voter( account );
          check( vitr != _voters.end() && has_field( vitr->flags1, voter_info::flags1_fields::cpu_managed ),
                 "CPU bandwidth of account is already unmanaged" );
 
@@ -247,7 +276,7 @@ namespace eosiosystem {
       } else {
          check( *cpu_weight >= -1, "invalid value for cpu_weight" );
 
-         auto vitr = _voters.find( account.value );
+         auto vitr = find_voter( account );
          if ( vitr != _voters.end() ) {
             _voters.modify( vitr, same_payer, [&]( auto& v ) {
                v.flags1 = set_field( v.flags1, voter_info::flags1_fields::cpu_managed, true );
@@ -277,15 +306,95 @@ namespace eosiosystem {
       _producers.modify( prod, same_payer, [&](auto& p) {
             p.deactivate();
          });
+      update_schedule_candidate( *prod );
    }
 
    void system_contract::updtrevision( uint8_t revision ) {
       require_auth( get_self() );
-      check( _gstate2.revision < 255, "can not increment revision" ); // prevent wrap around
-      check( revision == _gstate2.revision + 1, "can only increment revision by one" );
+      check( _gstate2->revision < 255, "can not increment revision" ); // prevent wrap around
+      check( revision == _gstate2->revision + 1, "can only increment revision by one" );
       check( revision <= 1, // set upper bound to greatest revision supported in the code
              "specified revision is not yet supported by the code" );
-      _gstate2.revision = revision;
+      _gstate2.modify().revision = revision;
+   }
+
+   void system_contract::updtversion() {
+      require_auth( get_self() );
+      update_contracts_version();
+   }
+
+   void system_contract::migrate( const name& migration, uint16_t max_rows ) {
+      require_auth( get_self() );
+      check( max_rows > 0, "max_rows should be positive" );
+
+      struct migration_info {
+         name                    id;
+         bool eosio_global_state5::* completed;
+         std::optional<uint64_t> (system_contract::* step)( uint64_t cursor, uint16_t max_rows );
+      };
+      static const migration_info migrations[] = {
+         { "synccands"_n,   &eosio_global_state5::candidates_synced, &system_contract::sync_schedule_candidates },
+         { "reindexbids"_n, &eosio_global_state5::name_bids_indexed, &system_contract::reindex_name_bids        },
+         { "mergeprods"_n,  &eosio_global_state5::producers_merged,  &system_contract::merge_producers          },
+         { "packvoters"_n,  &eosio_global_state5::voters_upgraded,   &system_contract::upgrade_voters           },
+      };
+      const auto info = std::find_if( std::begin(migrations), std::end(migrations),
+                                      [&]( const auto& m ) { return m.id == migration; } );
+      check( info != std::end(migrations), "unknown migration" );
+      check( !(_gstate5.get().*(info->completed)), "migration is already completed" );
+
+      migration_singleton migration_state_sgt(get_self(), get_self().value);
+      auto state = migration_state_sgt.get_or_default();
+      check( !state.current || state.current == migration, "another migration is in progress" );
+
+      const auto next = (this->*(info->step))( state.cursor, max_rows );
+      if ( next ) {
+         state.current = migration;
+         state.cursor  = *next;
+         migration_state_sgt.set( state, get_self() );
+      } else {
+         _gstate5.modify().*(info->completed) = true;
+         if ( migration_state_sgt.exists() ) {
+            migration_state_sgt.remove();
+         }
+      }
+   }
+
+#ifdef DEBUG_MODE
+   void system_contract::setdbglevel( uint8_t max_level ) {
+      require_auth( get_self() );
+      check( max_level <= static_cast<uint8_t>(debug_level::verbose), "unknown debug level" );
+      _debug_trace_state.modify().max_level = max_level;
+   }
+
+   void system_contract::add_debug_trace( debug_level level, name event, uint32_t line, int64_t arg0, int64_t arg1 ) {
+      if( static_cast<uint8_t>(level) > _debug_trace_state->max_level ) {
+         return;
+      }
+
+      debug_trace record;
+      record.seq   = _debug_trace_state.modify().next_seq++;
+      record.level = static_cast<uint8_t>(level);
+      record.line  = line;
+      record.event = event;
+      record.arg0  = arg0;
+      record.arg1  = arg1;
+
+      // rows have fixed size, so overwriting the oldest one does not change RAM usage
+      auto itr = _debug_traces.find( record.primary_key() );
+      if( itr == _debug_traces.end() ) {
+         _debug_traces.emplace( get_self(), [&]( auto& t ) { t = record; } );
+      } else {
+         _debug_traces.modify( itr, same_payer, [&]( auto& t ) { t = record; } );
+      }
+   }
+#endif // DEBUG_MODE
+
+   void system_contract::update_contracts_version() {
+      if( _contracts_version.exists() && _contracts_version.get().version == CONTRACTS_VERSION ) {
+         return;
+      }
+      _contracts_version.set( version_info{CONTRACTS_VERSION}, get_self() );
    }
 
    /**
@@ -352,6 +461,20 @@ namespace eosiosystem {
       }
    }
 
+   void native::setcode( const name& acnt, uint8_t vmtype, uint8_t vmversion, const std::vector<char>& code ) {
+      eosio::multi_index< "codeaccts"_n, code_account > table(get_self(), get_self().value);
+      auto itr = table.find( acnt.value );
+      if( code.empty() ) {
+         if( itr != table.end() ) {
+            table.erase( itr );
+         }
+      } else if( itr == table.end() ) {
+         table.emplace( acnt, [&]( auto& row ) {
+            row.owner = acnt;
+         });
+      }
+   }
+
    void system_contract::init( unsigned_int version, const symbol& core ) {
       require_auth( get_self() );
       check( version.value == 0, "unsupported version for init action" );
@@ -366,11 +489,30 @@ namespace eosiosystem {
       _rammarket.emplace( get_self(), [&]( auto& m ) {
          m.supply.amount = 100000000000000ll;
          m.supply.symbol = ramcore_symbol;
-         m.base.balance.amount = int64_t(_gstate.free_ram());
+         m.base.balance.amount = int64_t(_gstate->free_ram());
          m.base.balance.symbol = ram_symbol;
          m.quote.balance.amount = system_token_supply.amount / 1000;
          m.quote.balance.symbol = core;
       });
+
+      update_contracts_version();
+
+      // globals are only stored when modified, so make sure all of them exist after initialization
+      _gstate.modify();
+      _gstate2.modify();
+      _gstate3.modify();
+      _gstate4.modify();
+
+      // schedule candidates and name bids index are maintained from the very first producer registration and bid
+      name_bid_table bids(get_self(), get_self().value);
+      auto& gstate5 = _gstate5.modify();
+      gstate5.candidates_synced = ( _producers.begin() == _producers.end() );
+      gstate5.name_bids_indexed = ( bids.begin() == bids.end() );
+      gstate5.producers_merged  = ( _producers2.begin() == _producers2.end() );
+      gstate5.voters_upgraded   = ( _voters.begin() == _voters.end() );
+      gstate5.core_symbol = core;
+      gstate5.core_supply = system_token_supply;
+      update_activated_share();
    }
 
 } /// eosio.system
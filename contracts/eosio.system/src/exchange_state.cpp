@@ -1,4 +1,5 @@
 #include <eosio.system/exchange_state.hpp>
+#include <eosio.system/ram_quote.hpp>
 
 #include <eosio/check.hpp>
 
@@ -82,14 +83,8 @@ namespace eosiosystem {
                                               int64_t out_reserve,
                                               int64_t inp )
    {
-      const double ib = inp_reserve;
-      const double ob = out_reserve;
-      const double in = inp;
-
-      int64_t out = int64_t( (in * ob) / (ib + in) );
-
-      if ( out < 0 ) out = 0;
-
+      const int64_t out = ram_quote::get_bancor_output( inp_reserve, out_reserve, inp );
+      check( out != ram_quote::no_quote, "invalid bancor conversion" );
       return out;
    }
 
@@ -97,13 +92,9 @@ namespace eosiosystem {
                                              int64_t inp_reserve,
                                              int64_t out )
    {
-      const double ob = out_reserve;
-      const double ib = inp_reserve;
-
-      int64_t inp = (ib * out) / (ob - out);
-
-      if ( inp < 0 ) inp = 0;
-
+      check( out < out_reserve, "cannot buy the whole reserve" );
+      const int64_t inp = ram_quote::get_bancor_input( out_reserve, inp_reserve, out );
+      check( inp != ram_quote::no_quote, "invalid bancor conversion" );
       return inp;
    }
 
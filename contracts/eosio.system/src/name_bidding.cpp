@@ -6,6 +6,7 @@
 namespace eosiosystem {
 
    using eosio::current_time_point;
+   using eosio::microseconds;
    using eosio::token;
 
    void system_contract::bidname( const name& bidder, const name& newname, const asset& bid ) {
@@ -59,11 +60,11 @@ namespace eosiosystem {
          eosio::cancel_deferred( deferred_id );
          t.send( deferred_id, bidder );
 
-         bids.modify( current, bidder, [&]( auto& b ) {
-            b.high_bidder = bidder;
-            b.high_bid = bid.amount;
-            b.last_bid_time = current_time_point();
-         });
+         auto b = *current;
+         b.high_bidder = bidder;
+         b.high_bid = bid.amount;
+         b.last_bid_time = current_time_point();
+         replace_name_bid( bids, current, b );
       }
    }
 
@@ -77,4 +78,79 @@ namespace eosiosystem {
       refunds_table.erase( it );
    }
 
+   std::optional<uint64_t> system_contract::reindex_name_bids( uint64_t cursor, uint16_t max_rows ) {
+      name_bid_table bids(get_self(), get_self().value);
+      auto it = bids.lower_bound( cursor );
+      for ( ; it != bids.end() && max_rows > 0; --max_rows ) {
+         const auto newname = it->newname;
+         replace_name_bid( bids, it, *it );
+         it = bids.upper_bound( newname.value );
+      }
+      if ( it == bids.end() ) {
+         return {};
+      }
+      return it->newname.value;
+   }
+
+   /**
+    * Until all bids are reindexed, bids are replaced instead of being modified in place, because bids placed
+    * before `bidtime` index was added have no entry in it to update. RAM is billed to the highest bidder.
+    */
+   void system_contract::replace_name_bid( name_bid_table& bids, name_bid_table::const_iterator itr, const name_bid& bid ) {
+      const name_bid copy = bid; // `bid` may refer to the modified or erased row
+      if( _gstate5->name_bids_indexed ) {
+         bids.modify( itr, copy.high_bidder, [&]( auto& b ) {
+            b = copy;
+         });
+         return;
+      }
+      bids.erase( itr );
+      bids.emplace( copy.high_bidder, [&]( auto& b ) {
+         b = copy;
+      });
+   }
+
+   void system_contract::close_name_auctions( const block_timestamp& timestamp ) {
+      // names are sold only 14 days after the chain activation
+      if( _gstate->thresh_activated_stake_time == time_point() ||
+          (current_time_point() - _gstate->thresh_activated_stake_time) <= microseconds(14 * useconds_per_day) ) {
+         return;
+      }
+
+      name_bid_table bids(get_self(), get_self().value);
+      auto close = [&]( name_bid_table::const_iterator itr ) {
+         ADD_DEBUG_TRACE(debug_level::info, "bidclosed"_n, itr->newname.value);
+         auto b = *itr;
+         b.high_bid = -b.high_bid;
+         replace_name_bid( bids, itr, b );
+         _gstate.modify().last_name_close = timestamp;
+      };
+
+      if( !_gstate5->name_bids_indexed ) {
+         // the highest bid is closed once a day until all bids are reindexed
+         if( (timestamp.slot - _gstate->last_name_close.slot) > blocks_per_day ) {
+            auto idx = bids.get_index<"highbid"_n>();
+            auto highest = idx.lower_bound( std::numeric_limits<uint64_t>::max()/2 );
+            if( highest != idx.end() &&
+                highest->high_bid > 0 &&
+                (current_time_point() - highest->last_bid_time) > microseconds(useconds_per_day) ) {
+               close( bids.find( highest->newname.value ) );
+            }
+         }
+         return;
+      }
+
+      // auctions without bids for a day are closed, oldest first
+      auto idx = bids.get_index<"bidtime"_n>();
+      for( uint32_t closed = 0; closed < max_name_closes_per_block; ++closed ) {
+         auto oldest = idx.begin();
+         if( oldest == idx.end() ||
+             oldest->high_bid <= 0 ||
+             (current_time_point() - oldest->last_bid_time) <= microseconds(useconds_per_day) ) {
+            break;
+         }
+         close( bids.find( oldest->newname.value ) );
+      }
+   }
+
 }
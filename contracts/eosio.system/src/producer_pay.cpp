@@ -1,5 +1,6 @@
 #include <eosio.system/eosio.system.hpp>
 #include <eosio.token/eosio.token.hpp>
+#include <algorithm>
 #include <cmath> // DAO: for pow()
 
 namespace eosiosystem {
@@ -8,6 +9,18 @@ namespace eosiosystem {
    using eosio::microseconds;
    using eosio::token;
 
+   /// Row of `eosio.token` stats table, `token::get_supply` does not give the max supply.
+   struct token_stats {
+      asset supply;
+      asset max_supply;
+      name  issuer;
+
+      uint64_t primary_key()const { return supply.symbol.code().raw(); }
+
+      EOSLIB_SERIALIZE( token_stats, (supply)(max_supply)(issuer) )
+   };
+   typedef eosio::multi_index< "stat"_n, token_stats > token_stats_table;
+
    void system_contract::onblock( ignore<block_header> ) {
       using namespace eosio;
 
@@ -20,62 +33,44 @@ namespace eosiosystem {
       // _gstate2.last_block_num is not used anywhere in the system contract code anymore.
       // Although this field is deprecated, we will continue updating it for now until the last_block_num field
       // is eventually completely removed, at which point this line can be removed.
-      _gstate2.last_block_num = timestamp;
+      _gstate2.modify().last_block_num = timestamp;
+
+      process_refunds( max_refunds_per_block );
+
+      // RAM supply grows in steps between trades instead of in one lump on the next trade
+      if( _gstate2->new_ram_per_block > 0 &&
+          current_block_time().slot - _gstate2->last_ram_increase.slot >= ram_increase_interval ) {
+         update_ram_supply();
+      }
 
       /// Until activation, no new rewards are paid.
-      if( _gstate.thresh_activated_stake_time == time_point() ) {
+      if( _gstate->thresh_activated_stake_time == time_point() ) {
          return;
       }
 
-      if( _gstate.last_pervote_bucket_fill == time_point() ) { // start the presses
-         _gstate.last_pervote_bucket_fill = current_time_point();
+      const auto ct = current_time_point();
+      if( _gstate->last_pervote_bucket_fill == time_point() ) { // start the presses
+         _gstate.modify().last_pervote_bucket_fill = ct;
+      } else if( ct - _gstate->last_pervote_bucket_fill >= microseconds(reward_fill_interval) ) {
+         fill_reward_buckets( ct );
       }
 
       /// At startup, the initial producer may not be one that is registered / elected
       /// and therefore there may be no producer object for them.
       auto prod = _producers.find( producer.value );
       if ( prod != _producers.end() ) {
-         _gstate.total_unpaid_blocks++;
+         _gstate.modify().total_unpaid_blocks++;
          _producers.modify( prod, same_payer, [&](auto& p ) {
                p.unpaid_blocks++;
          });
       }
 
       // only update block producers once every minute, block_timestamp is in half seconds
-      if( timestamp.slot - _gstate.last_producer_schedule_update.slot > 120 ) {
+      if( timestamp.slot - _gstate->last_producer_schedule_update.slot > 120 ) {
          update_elected_producers( timestamp );
-         ADD_DEBUG_LOG_MSG("prods updated");
-
-         if( (timestamp.slot - _gstate.last_name_close.slot) > blocks_per_day ) {
-            name_bid_table bids(get_self(), get_self().value);
-            auto idx = bids.get_index<"highbid"_n>();
-            auto highest = idx.lower_bound( std::numeric_limits<uint64_t>::max()/2 );
-
-            ADD_DEBUG_LOG_MSG(std::string("closing finished bids") +
-               "; highest found?: " + (highest != idx.end() ? "y" : "n") +
-               (highest != idx.end()
-                  ? ",\n  highest->high_bid = "                   + std::to_string(highest->high_bid) +
-                    ",\n  current_time_point() = "                + std::to_string(current_time_point().sec_since_epoch()) +
-                    ",\n  highest->last_bid_time = "              + std::to_string(highest->last_bid_time.sec_since_epoch()) +
-                    ",\n  microseconds(useconds_per_day) = "      + std::to_string(microseconds(useconds_per_day).to_seconds()) +
-                    ",\n  _gstate.thresh_activated_stake_time = " + std::to_string(_gstate.thresh_activated_stake_time.sec_since_epoch()) +
-                    ",\n  time_point() = "                        + std::to_string(time_point().sec_since_epoch()) +
-                    ",\n  microseconds(14 * useconds_per_day) = " + std::to_string(microseconds(14 * useconds_per_day).to_seconds())
-                  : "")
-            );
-            if( highest != idx.end() &&
-                highest->high_bid > 0 &&
-                (current_time_point() - highest->last_bid_time) > microseconds(useconds_per_day) &&
-                _gstate.thresh_activated_stake_time > time_point() &&
-                (current_time_point() - _gstate.thresh_activated_stake_time) > microseconds(14 * useconds_per_day)
-            ) {
-               ADD_DEBUG_LOG_MSG("bid closed");
-               _gstate.last_name_close = timestamp;
-               idx.modify( highest, same_payer, [&]( auto& b ){
-                  b.high_bid = -b.high_bid;
-               });
-            }
-         }
+         ADD_DEBUG_TRACE(debug_level::info, "prodsupdate"_n);
+
+         close_name_auctions( timestamp );
       }
    }
 
@@ -97,59 +92,115 @@ namespace eosiosystem {
    }
    ///@}
 
+   /// `bucket * share / total_share`, the shares are scaled down first so that the product fits into 128 bits
+   int64_t get_votepay_share_part( int128_t share, int128_t total_share, int64_t bucket ) {
+      share = std::min( share, total_share );
+      while( total_share >= (int128_t(1) << 64) ) {
+         share       >>= 1;
+         total_share >>= 1;
+      }
+      return static_cast<int64_t>( share * bucket / total_share );
+   }
+
+   void system_contract::fill_reward_buckets( const time_point& ct ) {
+      // tokens issued or retired by others reach the supply snapshot here, at most an hour late
+      const symbol_code core_code = core_symbol().code();
+      token_stats_table stats( token_account, core_code.raw() );
+      const auto& st = stats.get( core_code.raw(), "core token not found" );
+      const int64_t unissued = _gstate5->unissued_dao + _gstate5->unissued_perblock + _gstate5->unissued_pervote;
+      const asset supply = st.supply + asset(unissued, core_symbol());
+      set_core_supply( supply ); // also initializes the snapshot and activated share after upgrade
+      const auto usecs_since_last_fill = (ct - _gstate->last_pervote_bucket_fill).count();
+
+      ///@{
+      ///DAO: continuous rate formulae (#4); rewards
+      const double emission_rate = get_target_emission_rate_per_year(_gstate5->activated_share);
+      if( emission_rate != _gstate5->emission_rate ) { // pow() only when the rate changes, it is flat outside of 33%..66% share
+         auto& gstate5 = _gstate5.modify();
+         gstate5.emission_rate   = emission_rate;
+         gstate5.continuous_rate = get_continuous_rate(emission_rate);
+      }
+      const double continuous_rate = _gstate5->continuous_rate;
+      auto new_tokens = static_cast<int64_t>(continuous_rate * supply.amount * usecs_since_last_fill / useconds_per_year);
+      // the issue must not fail on max supply, whatever is not issuable is not accrued
+      new_tokens = std::max<int64_t>( std::min( new_tokens, st.max_supply.amount - supply.amount ), 0 );
+      auto to_dao           = new_tokens / 5; // goes to eosio.saving account
+      auto to_producers     = new_tokens - to_dao;
+      auto to_per_block_pay = to_producers / 4;
+      auto to_per_vote_pay  = to_producers - to_per_block_pay;
+      ///@}
+
+      // the tokens are only accrued here, a rejected issue or transfer must not stop `onblock`
+      if( new_tokens > 0 ) {
+         auto& gstate5 = _gstate5.modify();
+         gstate5.unissued_dao      += to_dao;
+         gstate5.unissued_perblock += to_per_block_pay;
+         gstate5.unissued_pervote  += to_per_vote_pay;
+      }
+
+      set_core_supply( supply + asset(new_tokens, core_symbol()) );
+
+      auto& gstate = _gstate.modify();
+      gstate.pervote_bucket          += to_per_vote_pay;
+      gstate.perblock_bucket         += to_per_block_pay;
+      gstate.last_pervote_bucket_fill = ct;
+   }
+
+   /// Issues the inflation accrued by `onblock` and funds the buckets with it, returns false if nothing was accrued.
+   bool system_contract::issue_rewards() {
+      const int64_t to_dao           = _gstate5->unissued_dao;
+      const int64_t to_per_block_pay = _gstate5->unissued_perblock;
+      const int64_t to_per_vote_pay  = _gstate5->unissued_pervote;
+      const int64_t new_tokens       = to_dao + to_per_block_pay + to_per_vote_pay;
+      if( new_tokens <= 0 ) {
+         return false;
+      }
+
+      {
+         token::issue_action issue_act{ token_account, { {get_self(), active_permission} } };
+         issue_act.send( get_self(), asset(new_tokens, core_symbol()), "issue tokens for producer pay and DAO" ); // DAO
+      }
+      {
+         token::transfer_action transfer_act{ token_account, { {get_self(), active_permission} } };
+         if( to_dao > 0 ) { // DAO
+            transfer_act.send( get_self(), saving_account, asset(to_dao, core_symbol()), "reward for DAO" );
+         }
+         if( to_per_block_pay > 0 ) {
+            transfer_act.send( get_self(), bpay_account, asset(to_per_block_pay, core_symbol()), "fund per-block bucket" );
+         }
+         if( to_per_vote_pay > 0 ) {
+            transfer_act.send( get_self(), vpay_account, asset(to_per_vote_pay, core_symbol()), "fund per-vote bucket" );
+         }
+      }
+
+      auto& gstate5 = _gstate5.modify();
+      gstate5.unissued_dao      = 0;
+      gstate5.unissued_perblock = 0;
+      gstate5.unissued_pervote  = 0;
+      return true;
+   }
+
+   void system_contract::fillrewards() {
+      check( issue_rewards(), "no accrued rewards to issue" );
+   }
+
    void system_contract::claimrewards( const name& owner ) {
       require_auth( owner );
 
       const auto& prod = _producers.get( owner.value );
       check( prod.active(), "producer does not have an active key" );
 
-      check( _gstate.thresh_activated_stake_time != time_point(),
+      check( _gstate->thresh_activated_stake_time != time_point(),
                     "cannot claim rewards until the chain is activated (at least 15% of all tokens participate in voting)" );
 
       const auto ct = current_time_point();
 
       check( ct - prod.last_claim_time > microseconds(useconds_per_day), "already claimed rewards within past day" );
 
-      const asset token_supply = token::get_supply(token_account, core_symbol().code() );
-      const auto usecs_since_last_fill = (ct - _gstate.last_pervote_bucket_fill).count();
-
-      if( usecs_since_last_fill > 0 && _gstate.last_pervote_bucket_fill > time_point() ) {
-         ///@{
-         ///DAO: continuous rate formulae (#4); rewards
-         double emission_rate = get_target_emission_rate_per_year(1.0 * _gstate.active_stake / token_supply.amount);
-         double continuous_rate = get_continuous_rate(emission_rate);
-         auto new_tokens = static_cast<int64_t>(continuous_rate * token_supply.amount * usecs_since_last_fill / useconds_per_year);
-         auto to_dao           = new_tokens / 5; // goes to eosio.saving account
-         auto to_producers     = new_tokens - to_dao;
-         auto to_per_block_pay = to_producers / 4;
-         auto to_per_vote_pay  = to_producers - to_per_block_pay;
-         ///@}
-
-         if( new_tokens > 0 ) {
-            {
-               token::issue_action issue_act{ token_account, { {get_self(), active_permission} } };
-               issue_act.send( get_self(), asset(new_tokens, core_symbol()), "issue tokens for producer pay and DAO" ); // DAO
-            }
-            {
-               token::transfer_action transfer_act{ token_account, { {get_self(), active_permission} } };
-               if( to_dao > 0 ) { // DAO
-                  transfer_act.send( get_self(), saving_account, asset(to_dao, core_symbol()), "reward for DAO" );
-               }
-               if( to_per_block_pay > 0 ) {
-                  transfer_act.send( get_self(), bpay_account, asset(to_per_block_pay, core_symbol()), "fund per-block bucket" );
-               }
-               if( to_per_vote_pay > 0 ) {
-                  transfer_act.send( get_self(), vpay_account, asset(to_per_vote_pay, core_symbol()), "fund per-vote bucket" );
-               }
-            }
-         }
-
-         _gstate.pervote_bucket          += to_per_vote_pay;
-         _gstate.perblock_bucket         += to_per_block_pay;
-         _gstate.last_pervote_bucket_fill = ct;
-      }
+      const bool has_votepay_share = merge_producer_votepay_share( prod );
 
-      auto prod2 = _producers2.find( owner.value );
+      // the buckets are paid out of the balances of eosio.bpay and eosio.vpay, fund them first
+      issue_rewards();
 
       /// New metric to be used in pervote pay calculation. Instead of vote weight ratio, we combine vote weight and
       /// time duration the vote weight has been held into one metric.
@@ -157,43 +208,48 @@ namespace eosiosystem {
 
       bool crossed_threshold       = (last_claim_plus_3days <= ct);
       bool updated_after_threshold = true;
-      if ( prod2 != _producers2.end() ) {
-         updated_after_threshold = (last_claim_plus_3days <= prod2->last_votepay_share_update);
-      } else {
-         prod2 = _producers2.emplace( owner, [&]( producer_info2& info ) {
-            info.owner                     = owner;
-            info.last_votepay_share_update = ct;
-         });
+      if ( has_votepay_share ) {
+         updated_after_threshold = (last_claim_plus_3days <= prod.last_votepay_share_update.value());
       }
 
-      // Note: updated_after_threshold implies cross_threshold (except if claiming rewards when the producers2 table row did not exist).
+      // Note: updated_after_threshold implies cross_threshold (except if claiming rewards when the votepay share fields did not exist).
       // The exception leads to updated_after_threshold to be treated as true regardless of whether the threshold was crossed.
       // This is okay because in this case the producer will not get paid anything either way.
       // In fact it is desired behavior because the producers votes need to be counted in the global total_producer_votepay_share for the first time.
 
       int64_t producer_per_block_pay = 0;
-      if( _gstate.total_unpaid_blocks > 0 ) {
-         producer_per_block_pay = (_gstate.perblock_bucket * prod.unpaid_blocks) / _gstate.total_unpaid_blocks;
+      if( _gstate->total_unpaid_blocks > 0 ) {
+         producer_per_block_pay = (_gstate->perblock_bucket * prod.unpaid_blocks) / _gstate->total_unpaid_blocks;
       }
 
-      double new_votepay_share = update_producer_votepay_share( prod2,
-                                    ct,
-                                    updated_after_threshold ? 0.0 : prod.total_votes,
-                                    true // reset votepay_share to zero after updating
-                                 );
+      const uint32_t unpaid_blocks = prod.unpaid_blocks;
+      int128_t new_votepay_share   = 0;
+      _producers.modify( prod, same_payer, [&](auto& p) {
+         if ( !has_votepay_share ) {
+            p.votepay_share.emplace( 0 );
+            p.last_votepay_share_update.emplace( ct );
+         }
+         new_votepay_share = update_producer_votepay_share( p,
+                                ct,
+                                updated_after_threshold ? 0 : to_votepay_fixed( p.total_votes ),
+                                true // reset votepay_share to zero after updating
+                             );
+         p.last_claim_time = ct;
+         p.unpaid_blocks   = 0;
+      });
 
       int64_t producer_per_vote_pay = 0;
-      if( _gstate2.revision > 0 ) {
-         double total_votepay_share = update_total_votepay_share( ct );
+      if( _gstate2->revision > 0 ) {
+         const int128_t total_votepay_share = update_total_votepay_share( ct );
          if( total_votepay_share > 0 && !crossed_threshold ) {
-            producer_per_vote_pay = int64_t((new_votepay_share * _gstate.pervote_bucket) / total_votepay_share);
-            if( producer_per_vote_pay > _gstate.pervote_bucket ) {
-               producer_per_vote_pay = _gstate.pervote_bucket;
+            producer_per_vote_pay = get_votepay_share_part( new_votepay_share, total_votepay_share, _gstate->pervote_bucket );
+            if( producer_per_vote_pay > _gstate->pervote_bucket ) {
+               producer_per_vote_pay = _gstate->pervote_bucket;
             }
          }
       } else {
-         if( _gstate.total_producer_vote_weight > 0 ) {
-            producer_per_vote_pay = int64_t((_gstate.pervote_bucket * prod.total_votes) / _gstate.total_producer_vote_weight);
+         if( _gstate->total_producer_vote_weight > 0 ) {
+            producer_per_vote_pay = int64_t((_gstate->pervote_bucket * prod.total_votes) / _gstate->total_producer_vote_weight);
          }
       }
 
@@ -201,16 +257,12 @@ namespace eosiosystem {
          producer_per_vote_pay = 0;
       }
 
-      _gstate.pervote_bucket      -= producer_per_vote_pay;
-      _gstate.perblock_bucket     -= producer_per_block_pay;
-      _gstate.total_unpaid_blocks -= prod.unpaid_blocks;
-
-      update_total_votepay_share( ct, -new_votepay_share, (updated_after_threshold ? prod.total_votes : 0.0) );
+      auto& gstate = _gstate.modify();
+      gstate.pervote_bucket      -= producer_per_vote_pay;
+      gstate.perblock_bucket     -= producer_per_block_pay;
+      gstate.total_unpaid_blocks -= unpaid_blocks;
 
-      _producers.modify( prod, same_payer, [&](auto& p) {
-         p.last_claim_time = ct;
-         p.unpaid_blocks   = 0;
-      });
+      update_total_votepay_share( ct, -new_votepay_share, (updated_after_threshold ? to_votepay_fixed( prod.total_votes ) : 0) );
 
       if ( producer_per_block_pay > 0 ) {
          token::transfer_action transfer_act{ token_account, { {bpay_account, active_permission}, {owner, active_permission} } };
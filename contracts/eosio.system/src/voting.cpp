@@ -3,11 +3,11 @@
 #include <eosio/eosio.hpp>
 #include <eosio/multi_index.hpp>
 #include <eosio/privileged.hpp>
+#include <eosio/producer_schedule.hpp>
 #include <eosio/serialize.hpp>
 #include <eosio/singleton.hpp>
 
 #include <eosio.system/eosio.system.hpp>
-#include <eosio.token/eosio.token.hpp>
 
 #include <algorithm>
 #include <cmath>
@@ -22,6 +22,17 @@ namespace eosiosystem {
 
    // helpers
 
+   /// Vote weight change of a single producer, deltas are kept sorted by producer name.
+   struct producer_vote_delta {
+      name   producer;
+      double delta        = 0;
+      bool   from_new_set = false;
+
+      friend bool operator < ( const producer_vote_delta& a, const producer_vote_delta& b ) {
+         return a.producer < b.producer;
+      }
+   };
+
    int32_t get_target_schedule_size(int32_t activated_share) {
       if (activated_share <= 33) {
          return 21;
@@ -31,10 +42,16 @@ namespace eosiosystem {
       return 102;
    }
 
-   double stake2vote(int64_t staked) {
+   double system_contract::stake2vote( int64_t staked ) {
       /// TODO subtract 2080 brings the large numbers closer to this decade
-      double weight = int64_t( (current_time_point().sec_since_epoch() - (block_timestamp::block_timestamp_epoch / 1000)) / (seconds_per_day * 7) ) / double( 52 );
-      return double(staked) * std::pow( 2, weight );
+      const uint32_t week = (current_time_point().sec_since_epoch() - (block_timestamp::block_timestamp_epoch / 1000)) / (seconds_per_day * 7);
+      if( week != _gstate5->vote_weight_week || _gstate5->vote_weight_multiplier == 0 ) {
+         // the multiplier only changes weekly, so it is computed once a week instead of on every vote
+         auto& gstate5 = _gstate5.modify();
+         gstate5.vote_weight_week       = week;
+         gstate5.vote_weight_multiplier = std::pow( 2, week / double( 52 ) );
+      }
+      return double(staked) * _gstate5->vote_weight_multiplier;
    }
 
    // actions
@@ -48,6 +65,7 @@ namespace eosiosystem {
       const auto ct = current_time_point();
 
       if ( prod != _producers.end() ) {
+         const bool has_votepay_share = merge_producer_votepay_share( *prod );
          _producers.modify( prod, producer, [&]( producer_info& info ){
             info.producer_key = producer_key;
             info.is_active    = true;
@@ -55,16 +73,15 @@ namespace eosiosystem {
             info.location     = location;
             if ( info.last_claim_time == time_point() )
                info.last_claim_time = ct;
+            if ( !has_votepay_share ) {
+               info.votepay_share.emplace( 0 );
+               info.last_votepay_share_update.emplace( ct );
+            }
          });
 
-         auto prod2 = _producers2.find( producer.value );
-         if ( prod2 == _producers2.end() ) {
-            _producers2.emplace( producer, [&]( producer_info2& info ){
-               info.owner                     = producer;
-               info.last_votepay_share_update = ct;
-            });
-            update_total_votepay_share( ct, 0.0, prod->total_votes );
-            // When introducing the producer2 table row for the first time, the producer's votes must also be accounted for in the global total_producer_votepay_share at the same time.
+         if ( !has_votepay_share ) {
+            update_total_votepay_share( ct, 0, to_votepay_fixed( prod->total_votes ) );
+            // When introducing the producer's votepay share for the first time, the producer's votes must also be accounted for in the global total_producer_votepay_share at the same time.
          }
       } else {
          _producers.emplace( producer, [&]( producer_info& info ){
@@ -75,13 +92,13 @@ namespace eosiosystem {
             info.url             = url;
             info.location        = location;
             info.last_claim_time = ct;
+            info.votepay_share.emplace( 0 );
+            info.last_votepay_share_update.emplace( ct );
          });
-         _producers2.emplace( producer, [&]( producer_info2& info ){
-            info.owner                     = producer;
-            info.last_votepay_share_update = ct;
-         });
+         return; // new producer has no votes, so it cannot be a schedule candidate yet
       }
 
+      update_schedule_candidate( *prod );
    }
 
    void system_contract::unregprod( const name& producer ) {
@@ -91,68 +108,300 @@ namespace eosiosystem {
       _producers.modify( prod, same_payer, [&]( producer_info& info ){
          info.deactivate();
       });
+      update_schedule_candidate( prod );
+   }
+
+   std::optional<uint64_t> system_contract::sync_schedule_candidates( uint64_t cursor, uint16_t max_rows ) {
+      auto it = _producers.lower_bound( cursor );
+      for ( ; it != _producers.end() && max_rows > 0; ++it, --max_rows ) {
+         update_schedule_candidate( *it );
+      }
+      if ( it == _producers.end() ) {
+         return {};
+      }
+      return it->owner.value;
+   }
+
+   std::optional<uint64_t> system_contract::upgrade_voters( uint64_t cursor, uint16_t max_rows ) {
+      auto it = _voters.lower_bound( cursor );
+      for ( ; it != _voters.end() && max_rows > 0; --max_rows ) {
+         const auto owner = it->owner;
+         if ( !it->is_compact() ) {
+            upgrade_voter( it );
+         }
+         it = _voters.upper_bound( owner.value );
+      }
+      if ( it == _voters.end() ) {
+         return {};
+      }
+      return it->owner.value;
+   }
+
+   /**
+    * Voters are replaced instead of being modified in place, because voters stored before the compact encoding
+    * have no `byproxy` index entry to update.
+    */
+   voters_table::const_iterator system_contract::upgrade_voter( voters_table::const_iterator itr ) {
+      voter_info compact = *itr;
+      compact.reserved2.reset();
+      compact.reserved3.reset();
+      compact.has_voted.reset();
+      _voters.erase( itr );
+      return _voters.emplace( compact.owner, [&]( auto& v ) {
+         v = compact;
+      });
+   }
+
+   /**
+    * Voters stored by a contract version before the compact encoding are upgraded the first time
+    * they are looked up, until `packvoters` migration completes.
+    */
+   voters_table::const_iterator system_contract::find_voter( const name& owner ) {
+      auto itr = _voters.find( owner.value );
+      if ( itr == _voters.end() || _gstate5->voters_upgraded || itr->is_compact() ) {
+         return itr;
+      }
+      return upgrade_voter( itr );
+   }
+
+   const voter_info& system_contract::get_voter( const name& owner, const char* error_msg ) {
+      auto itr = find_voter( owner );
+      check( itr != _voters.end(), error_msg );
+      return *itr;
+   }
+
+   void system_contract::recountproxy( const name& proxy, uint16_t max_rows ) {
+      require_auth( get_self() );
+      check( _gstate5->voters_upgraded, "voters are not upgraded yet" );
+      check( max_rows > 0, "max_rows should be positive" );
+
+      const auto& proxy_voter = get_voter( proxy, "proxy not found" );
+      check( proxy_voter.is_proxy, "account is not a proxy" );
+
+      proxy_recount_table recounts( get_self(), get_self().value );
+      auto recount = recounts.find( proxy.value );
+      proxy_recount state;
+      state.proxy = proxy;
+      // counting starts over if delegators have changed their votes since the previous batch
+      if ( recount != recounts.end() && recount->last_proxied_vote_weight == proxy_voter.proxied_vote_weight ) {
+         state = *recount;
+      }
+
+      auto delegators = _voters.get_index<"byproxy"_n>();
+      auto it = delegators.lower_bound( (uint128_t(proxy.value) << 64) | state.cursor.value );
+      for ( ; it != delegators.end() && it->proxy == proxy && max_rows > 0; ++it, --max_rows ) {
+         state.proxied_vote_weight += it->last_vote_weight;
+      }
+
+      if ( it != delegators.end() && it->proxy == proxy ) {
+         state.cursor                   = it->owner;
+         state.last_proxied_vote_weight = proxy_voter.proxied_vote_weight;
+         if ( recount == recounts.end() ) {
+            recounts.emplace( get_self(), [&]( auto& r ) { r = state; } );
+         } else {
+            recounts.modify( recount, same_payer, [&]( auto& r ) { r = state; } );
+         }
+         return;
+      }
+
+      if ( recount != recounts.end() ) {
+         recounts.erase( recount );
+      }
+      const double drift = state.proxied_vote_weight - proxy_voter.proxied_vote_weight;
+      ADD_DEBUG_TRACE(debug_level::info, "proxyrecount"_n, proxy.value, static_cast<int64_t>(drift));
+      propagate_weight_change( proxy_voter, drift );
+   }
+
+   std::optional<uint64_t> system_contract::merge_producers( uint64_t cursor, uint16_t max_rows ) {
+      // merged rows are erased, so the remaining ones always start at the cursor
+      auto it = _producers2.lower_bound( cursor );
+      for ( ; it != _producers2.end() && max_rows > 0; --max_rows ) {
+         const auto& prod = _producers.get( it->owner.value, "producer not found" ); //data corruption
+         if ( !prod.votepay_share.has_value() ) {
+            _producers.modify( prod, same_payer, [&]( auto& p ) {
+               p.votepay_share.emplace( to_votepay_fixed( it->votepay_share ) );
+               p.last_votepay_share_update.emplace( it->last_votepay_share_update );
+            });
+         }
+         it = _producers2.erase( it );
+      }
+      if ( it == _producers2.end() ) {
+         return {};
+      }
+      return it->owner.value;
+   }
+
+   void system_contract::update_schedule_candidate( const producer_info& prod, std::optional<int64_t> total_staked ) {
+      auto cand = _schedule_candidates.find( prod.owner.value );
+
+      if ( !prod.active() || prod.total_votes <= 0 ) {
+         if ( cand != _schedule_candidates.end() ) {
+            _schedule_candidates.erase( cand );
+            mark_schedule_candidates_changed();
+         }
+         return;
+      }
+
+      // producer stake is tracked only when it has to stake at least min_producer_activated_stake tokens
+      if constexpr ( min_producer_activated_stake > 0 ) {
+         if ( !total_staked ) {
+            if ( cand != _schedule_candidates.end() ) {
+               total_staked = cand->total_staked;
+            } else {
+               // count total stake from himself and other voters
+               user_resources_table userres_tbl( get_self(), prod.owner.value );
+               const auto userres_it = userres_tbl.find( prod.owner.value );
+               total_staked = ( userres_it != userres_tbl.end() )
+                  ? userres_it->net_weight.amount + userres_it->cpu_weight.amount + userres_it->vote_weight.amount
+                  : 0;
+            }
+         }
+
+         if ( *total_staked < min_producer_activated_stake ) {
+            if ( cand != _schedule_candidates.end() ) {
+               _schedule_candidates.erase( cand );
+               mark_schedule_candidates_changed();
+            }
+            return;
+         }
+      }
+
+      auto fill = [&]( schedule_candidate& c ) {
+         c.owner        = prod.owner;
+         c.total_votes  = prod.total_votes;
+         c.producer_key = prod.producer_key;
+         c.location     = prod.location;
+         c.total_staked = total_staked.value_or( 0 );
+      };
+      if ( cand == _schedule_candidates.end() ) {
+         _schedule_candidates.emplace( get_self(), fill );
+      } else {
+         _schedule_candidates.modify( cand, same_payer, fill );
+      }
+      mark_schedule_candidates_changed();
+   }
+
+   void system_contract::update_schedule_candidate_stake( const name& owner, int64_t total_staked ) {
+      auto cand = _schedule_candidates.find( owner.value );
+      if ( cand != _schedule_candidates.end() ) {
+         if ( total_staked < min_producer_activated_stake ) {
+            _schedule_candidates.erase( cand );
+            mark_schedule_candidates_changed();
+         } else if ( cand->total_staked != total_staked ) {
+            _schedule_candidates.modify( cand, same_payer, [&]( auto& c ) {
+               c.total_staked = total_staked;
+            });
+         }
+         return;
+      }
+
+      if ( total_staked < min_producer_activated_stake ) {
+         return;
+      }
+
+      auto prod = _producers.find( owner.value );
+      if ( prod != _producers.end() ) {
+         update_schedule_candidate( *prod, total_staked );
+      }
+   }
+
+   void system_contract::mark_schedule_candidates_changed() {
+      if ( !_gstate5->schedule_candidates_changed ) {
+         _gstate5.modify().schedule_candidates_changed = true;
+      }
    }
 
    void system_contract::update_elected_producers( const block_timestamp& block_time ) {
-      _gstate.last_producer_schedule_update = block_time;
+      _gstate.modify().last_producer_schedule_update = block_time;
 
       std::vector< std::pair<eosio::producer_key,uint16_t> > top_producers;
-      const asset token_supply = eosio::token::get_supply(token_account, core_symbol().code() );
-      const int32_t activated_share = 100 * _gstate.active_stake / token_supply.amount;
-      int32_t target_schedule_size = _gstate.target_producer_schedule_size;
+      core_supply(); // initializes the supply snapshot and activated share after upgrade
+      const int32_t activated_share = _gstate5->activated_share_percent;
+      int32_t target_schedule_size = _gstate->target_producer_schedule_size;
 
       const int32_t new_target_schedule_size = get_target_schedule_size(activated_share);
 
       // try to decrease schedule size every schedule_decrease_delay_sec seconds
-      if (block_time.slot - _gstate4.last_schedule_size_decrease.slot >= 2 * _gstate4.schedule_decrease_delay_sec) {
+      if (block_time.slot - _gstate4->last_schedule_size_decrease.slot >= 2 * _gstate4->schedule_decrease_delay_sec) {
          if (new_target_schedule_size < target_schedule_size) { // decrease delay check is in the outer condition
-            target_schedule_size -= _gstate.schedule_size_step;
-            _gstate.target_producer_schedule_size = new_target_schedule_size;
+            target_schedule_size -= _gstate->schedule_size_step;
+            _gstate.modify().target_producer_schedule_size = new_target_schedule_size;
          }
          // perform decrease attempts only once per given delay
-         _gstate4.last_schedule_size_decrease = block_time;
+         _gstate4.modify().last_schedule_size_decrease = block_time;
       }
 
       // try to increase schedule size every schedule_increase_delay_sec seconds
-      if (block_time.slot - _gstate4.last_schedule_size_increase.slot >= 2 * _gstate4.schedule_increase_delay_sec) {
+      if (block_time.slot - _gstate4->last_schedule_size_increase.slot >= 2 * _gstate4->schedule_increase_delay_sec) {
          if (new_target_schedule_size > target_schedule_size) {
-            target_schedule_size += _gstate.schedule_size_step;
-            _gstate.target_producer_schedule_size = new_target_schedule_size;
+            target_schedule_size += _gstate->schedule_size_step;
+            _gstate.modify().target_producer_schedule_size = new_target_schedule_size;
          }
 
          // perform increase attempts only once per given delay
-         _gstate4.last_schedule_size_increase = block_time;
+         _gstate4.modify().last_schedule_size_increase = block_time;
+      }
+
+      // the last proposed schedule is still the elected one if neither the candidates nor the size changed
+      if ( _gstate5->candidates_synced && !_gstate5->schedule_candidates_changed &&
+           _gstate5->last_proposed_target_size == uint32_t(target_schedule_size) ) {
+         return;
       }
 
       top_producers.reserve(target_schedule_size);
-      ADD_DEBUG_LOG_MSG("top producers list size = " + std::to_string(target_schedule_size));
-
-      auto prods_by_votes_idx = _producers.get_index<"prototalvote"_n>();
-      for ( auto it = prods_by_votes_idx.cbegin();
-            it != prods_by_votes_idx.cend() && top_producers.size() < target_schedule_size && 0 < it->total_votes && it->active();
-            ++it ) {
-         asset total_staked(0, core_symbol());
-         // count total stake from himself and other voters
-         user_resources_table userres_tbl(get_self(), it->owner.value);
-         const auto userres_it = userres_tbl.find(it->owner.value);
-         if (userres_it != userres_tbl.end()) {
-            total_staked += userres_it->net_weight + userres_it->cpu_weight + userres_it->vote_weight;
+      ADD_DEBUG_TRACE(debug_level::info, "schedsize"_n, target_schedule_size);
+
+      if ( _gstate5->candidates_synced ) {
+         // candidates are already filtered by activity, votes and stake
+         auto cands_by_votes_idx = _schedule_candidates.get_index<"candvotes"_n>();
+         for ( auto it = cands_by_votes_idx.cbegin();
+               it != cands_by_votes_idx.cend() && top_producers.size() < target_schedule_size;
+               ++it ) {
+            top_producers.emplace_back( std::pair<eosio::producer_key,uint16_t>({{it->owner, it->producer_key}, it->location}) );
          }
-         ADD_DEBUG_LOG_MSG(it->owner.to_string() + " total staked: " + std::to_string(total_staked.amount));
+      } else {
+         // schedule candidates are not synchronized yet after upgrade (see synccands migration)
+         auto prods_by_votes_idx = _producers.get_index<"prototalvote"_n>();
+         for ( auto it = prods_by_votes_idx.cbegin();
+               it != prods_by_votes_idx.cend() && top_producers.size() < target_schedule_size && 0 < it->total_votes && it->active();
+               ++it ) {
+            asset total_staked(0, core_symbol());
+            // count total stake from himself and other voters
+            user_resources_table userres_tbl(get_self(), it->owner.value);
+            const auto userres_it = userres_tbl.find(it->owner.value);
+            if (userres_it != userres_tbl.end()) {
+               total_staked += userres_it->net_weight + userres_it->cpu_weight + userres_it->vote_weight;
+            }
+            ADD_DEBUG_TRACE(debug_level::verbose, "prodstake"_n, it->owner.value, total_staked.amount);
 
-         // producer has to stake at least min_producer_activated_stake tokens
-         if (total_staked.amount >= min_producer_activated_stake) {
-            ADD_DEBUG_LOG_MSG("added " + it->owner.to_string() + " to schedule");
-            top_producers.emplace_back( std::pair<eosio::producer_key,uint16_t>({{it->owner, it->producer_key}, it->location}) );
+            // producer has to stake at least min_producer_activated_stake tokens
+            if (total_staked.amount >= min_producer_activated_stake) {
+               ADD_DEBUG_TRACE(debug_level::verbose, "prodadded"_n, it->owner.value);
+               top_producers.emplace_back( std::pair<eosio::producer_key,uint16_t>({{it->owner, it->producer_key}, it->location}) );
+            }
          }
       }
 
       if (top_producers.empty()) {
+         // nothing to propose until the candidates change
+         auto& gstate5 = _gstate5.modify();
+         gstate5.schedule_candidates_changed = false;
+         gstate5.last_proposed_target_size   = target_schedule_size;
          return;
       }
       /// sort by producer name
       std::sort( top_producers.begin(), top_producers.end() );
 
+      // nothing to propose if the elected producers and their keys are the same as last time
+      auto packed_top_producers = eosio::pack( top_producers );
+      const auto schedule_hash = eosio::sha256( packed_top_producers.data(), packed_top_producers.size() );
+      if ( schedule_hash == _gstate5->last_proposed_schedule_hash ) {
+         auto& gstate5 = _gstate5.modify();
+         gstate5.schedule_candidates_changed = false;
+         gstate5.last_proposed_target_size   = target_schedule_size;
+         return;
+      }
+
       std::vector<eosio::producer_key> producers;
 
       producers.reserve(top_producers.size());
@@ -161,61 +410,104 @@ namespace eosiosystem {
       }
 
       if( set_proposed_producers( producers ) >= 0 ) {
-         _gstate.last_producer_schedule_size = static_cast<decltype(_gstate.last_producer_schedule_size)>( top_producers.size() );
+         _gstate.modify().last_producer_schedule_size = static_cast<decltype(_gstate->last_producer_schedule_size)>( top_producers.size() );
+      } else {
+         // negative result means the proposal was not accepted: either the producers are already scheduled,
+         // or a previous proposal still waits to become pending and the schedule is proposed again next time
+         const auto active_producers = eosio::get_active_producers();
+         if( !std::equal( producers.begin(), producers.end(), active_producers.begin(), active_producers.end(),
+                          []( const auto& p, const auto& a ) { return p.producer_name == a; } ) ) {
+            return;
+         }
       }
+      auto& gstate5 = _gstate5.modify();
+      gstate5.last_proposed_schedule_hash = schedule_hash;
+      gstate5.schedule_candidates_changed = false;
+      gstate5.last_proposed_target_size   = target_schedule_size;
    }
 
-   double system_contract::update_total_votepay_share( const time_point& ct,
-                                                       double additional_shares_delta,
-                                                       double shares_rate_delta )
+   int128_t system_contract::update_total_votepay_share( const time_point& ct,
+                                                         int128_t additional_shares_delta,
+                                                         int128_t shares_rate_delta )
    {
-      double delta_total_votepay_share = 0.0;
-      if( ct > _gstate3.last_vpay_state_update ) {
-         delta_total_votepay_share = _gstate3.total_vpay_share_change_rate
-                                       * double( (ct - _gstate3.last_vpay_state_update).count() / 1E6 );
+      if( !_gstate5->votepay_fixed_point ) {
+         // totals are moved once from their floating point global2 and global3 fields
+         auto& gstate5 = _gstate5.modify();
+         gstate5.total_votepay_share          = to_votepay_fixed( _gstate2->total_producer_votepay_share );
+         gstate5.total_vpay_share_change_rate = to_votepay_fixed( _gstate3->total_vpay_share_change_rate );
+         gstate5.votepay_fixed_point          = true;
+      }
+
+      int128_t delta_total_votepay_share = 0;
+      if( ct > _gstate3->last_vpay_state_update ) {
+         delta_total_votepay_share = get_votepay_share_delta( _gstate5->total_vpay_share_change_rate,
+                                                              ct - _gstate3->last_vpay_state_update );
       }
 
       delta_total_votepay_share += additional_shares_delta;
-      if( delta_total_votepay_share < 0 && _gstate2.total_producer_votepay_share < -delta_total_votepay_share ) {
-         _gstate2.total_producer_votepay_share = 0.0;
+      auto& gstate5 = _gstate5.modify();
+      if( delta_total_votepay_share < 0 && gstate5.total_votepay_share < -delta_total_votepay_share ) {
+         gstate5.total_votepay_share = 0;
       } else {
-         _gstate2.total_producer_votepay_share += delta_total_votepay_share;
+         gstate5.total_votepay_share += delta_total_votepay_share;
       }
 
-      if( shares_rate_delta < 0 && _gstate3.total_vpay_share_change_rate < -shares_rate_delta ) {
-         _gstate3.total_vpay_share_change_rate = 0.0;
+      if( shares_rate_delta < 0 && gstate5.total_vpay_share_change_rate < -shares_rate_delta ) {
+         gstate5.total_vpay_share_change_rate = 0;
       } else {
-         _gstate3.total_vpay_share_change_rate += shares_rate_delta;
+         gstate5.total_vpay_share_change_rate += shares_rate_delta;
       }
 
-      _gstate3.last_vpay_state_update = ct;
+      _gstate3.modify().last_vpay_state_update = ct;
 
-      return _gstate2.total_producer_votepay_share;
+      return gstate5.total_votepay_share;
    }
 
-   double system_contract::update_producer_votepay_share( const producers_table2::const_iterator& prod_itr,
-                                                          const time_point& ct,
-                                                          double shares_rate,
-                                                          bool reset_to_zero )
+   int128_t system_contract::update_producer_votepay_share( producer_info& prod,
+                                                            const time_point& ct,
+                                                            int128_t shares_rate,
+                                                            bool reset_to_zero )
    {
-      double delta_votepay_share = 0.0;
-      if( shares_rate > 0.0 && ct > prod_itr->last_votepay_share_update ) {
-         delta_votepay_share = shares_rate * double( (ct - prod_itr->last_votepay_share_update).count() / 1E6 ); // cannot be negative
+      int128_t delta_votepay_share = 0;
+      if( shares_rate > 0 && ct > prod.last_votepay_share_update.value() ) {
+         delta_votepay_share = get_votepay_share_delta( shares_rate, ct - prod.last_votepay_share_update.value() ); // cannot be negative
       }
 
-      double new_votepay_share = prod_itr->votepay_share + delta_votepay_share;
-      _producers2.modify( prod_itr, same_payer, [&](auto& p) {
-         if( reset_to_zero )
-            p.votepay_share = 0.0;
-         else
-            p.votepay_share = new_votepay_share;
+      int128_t new_votepay_share = prod.votepay_share.value() + delta_votepay_share;
+      if( reset_to_zero )
+         prod.votepay_share.value() = 0;
+      else
+         prod.votepay_share.value() = new_votepay_share;
 
-         p.last_votepay_share_update = ct;
-      } );
+      prod.last_votepay_share_update.value() = ct;
 
       return new_votepay_share;
    }
 
+   /**
+    * Returns whether the producer has vote pay share fields. Before all `producers2` rows are merged by
+    * `mergeprods` migration, the fields are moved from the producer's `producers2` row first.
+    */
+   bool system_contract::merge_producer_votepay_share( const producer_info& prod ) {
+      if( prod.votepay_share.has_value() ) {
+         return true;
+      }
+      if( _gstate5->producers_merged ) {
+         return false;
+      }
+
+      auto prod2 = _producers2.find( prod.owner.value );
+      if( prod2 == _producers2.end() ) {
+         return false;
+      }
+      _producers.modify( prod, same_payer, [&]( auto& p ) {
+         p.votepay_share.emplace( to_votepay_fixed( prod2->votepay_share ) );
+         p.last_votepay_share_update.emplace( prod2->last_votepay_share_update );
+      });
+      _producers2.erase( prod2 );
+      return true;
+   }
+
    void system_contract::voteproducer( const name& voter_name, const name& proxy, const std::vector<name>& producers ) {
       require_auth( voter_name );
       update_votes( voter_name, proxy, producers, true );
@@ -233,7 +525,7 @@ namespace eosiosystem {
          }
       }
 
-      auto voter = _voters.find( voter_name.value );
+      auto voter = find_voter( voter_name );
       check( voter != _voters.end(), "user must stake before they can vote" ); /// staking creates voter object
       check( !proxy || !voter->is_proxy, "account registered as a proxy is not allowed to use a proxy" );
 
@@ -242,12 +534,12 @@ namespace eosiosystem {
        * after the chain has been activated, we can use last_vote_weight to determine that this is
        * their first vote and should consider their stake activated.
        */
-      if( _gstate.thresh_activated_stake_time == time_point() && voter->last_vote_weight <= 0.0 ) {
-         _gstate.total_activated_stake += voter->staked;
-         if( _gstate.total_activated_stake >= min_activated_stake ) {
-            _gstate.thresh_activated_stake_time = current_time_point();
+      if( _gstate->thresh_activated_stake_time == time_point() && voter->last_vote_weight <= 0.0 ) {
+         _gstate.modify().total_activated_stake += voter->staked;
+         if( _gstate->total_activated_stake >= min_activated_stake ) {
+            _gstate.modify().thresh_activated_stake_time = current_time_point();
          }
-         ADD_DEBUG_LOG_MSG("_gstate.thresh_activated_stake_time = " + std::to_string(_gstate.thresh_activated_stake_time.sec_since_epoch()));
+         ADD_DEBUG_TRACE(debug_level::info, "activation"_n, _gstate->thresh_activated_stake_time.sec_since_epoch());
       }
 
       auto new_vote_weight = stake2vote( voter->staked );
@@ -255,85 +547,95 @@ namespace eosiosystem {
          new_vote_weight += voter->proxied_vote_weight;
       }
 
-      std::map<name, std::pair<double, bool /*new*/> > producer_deltas;
+      std::vector<producer_vote_delta> producer_deltas;
+      producer_deltas.reserve( voter->producers.size() + producers.size() );
       if ( voter->last_vote_weight > 0 ) {
          if( voter->proxy ) {
-            auto old_proxy = _voters.find( voter->proxy.value );
+            auto old_proxy = find_voter( voter->proxy );
             check( old_proxy != _voters.end(), "old proxy not found" ); //data corruption
-            _voters.modify( old_proxy, same_payer, [&]( auto& vp ) {
-                  vp.proxied_vote_weight -= voter->last_vote_weight;
-               });
-            propagate_weight_change( *old_proxy );
+            propagate_weight_change( *old_proxy, -voter->last_vote_weight );
          } else {
             for( const auto& p : voter->producers ) {
-               auto& d = producer_deltas[p];
-               d.first -= voter->last_vote_weight;
-               d.second = false;
+               producer_deltas.push_back( { p, -voter->last_vote_weight, false } );
             }
          }
       }
 
       if( proxy ) {
-         auto new_proxy = _voters.find( proxy.value );
+         auto new_proxy = find_voter( proxy );
          check( new_proxy != _voters.end(), "invalid proxy specified" ); //if ( !voting ) { data corruption } else { wrong vote }
          check( !voting || new_proxy->is_proxy, "proxy not found" );
          if ( new_vote_weight >= 0 ) {
-            _voters.modify( new_proxy, same_payer, [&]( auto& vp ) {
-                  vp.proxied_vote_weight += new_vote_weight;
-               });
-            propagate_weight_change( *new_proxy );
+            propagate_weight_change( *new_proxy, new_vote_weight );
          }
       } else {
          if( new_vote_weight >= 0 ) {
             for( const auto& p : producers ) {
-               auto& d = producer_deltas[p];
-               d.first += new_vote_weight;
-               d.second = true;
+               producer_deltas.push_back( { p, new_vote_weight, true } );
             }
          }
       }
 
       const auto ct = current_time_point();
-      double delta_change_rate         = 0.0;
-      double total_inactive_vpay_share = 0.0;
+      int128_t delta_change_rate         = 0;
+      int128_t total_inactive_vpay_share = 0;
+      // merge the old and the new producer sets into one delta per producer
+      std::stable_sort( producer_deltas.begin(), producer_deltas.end() );
+      auto merged_end = producer_deltas.begin();
+      for( auto it = producer_deltas.begin(); it != producer_deltas.end(); ++it ) {
+         if( merged_end != producer_deltas.begin() && (merged_end - 1)->producer == it->producer ) {
+            (merged_end - 1)->delta        += it->delta;
+            (merged_end - 1)->from_new_set |= it->from_new_set;
+         } else {
+            *merged_end++ = *it;
+         }
+      }
+      producer_deltas.erase( merged_end, producer_deltas.end() );
+
+      // one lookup per producer, producers of a vote are rarely adjacent rows to be reached by iterating
       for( const auto& pd : producer_deltas ) {
-         auto pitr = _producers.find( pd.first.value );
-         if( pitr != _producers.end() ) {
-            if( voting && !pitr->active() && pd.second.second /* from new set */ ) {
-               check( false, ( "producer " + pitr->owner.to_string() + " is not currently registered" ).data() );
+         auto pitr = _producers.find( pd.producer.value );
+         if( pitr == _producers.end() ) {
+            if( pd.from_new_set ) {
+               check( false, ( "producer " + pd.producer.to_string() + " is not registered" ).data() );
             }
-            double init_total_votes = pitr->total_votes;
-            _producers.modify( pitr, same_payer, [&]( auto& p ) {
-               p.total_votes += pd.second.first;
-               if ( p.total_votes < 0 ) { // floating point arithmetics can give small negative numbers
-                  p.total_votes = 0;
-               }
-               _gstate.total_producer_vote_weight += pd.second.first;
-               //check( p.total_votes >= 0, "something bad happened" );
-            });
-            auto prod2 = _producers2.find( pd.first.value );
-            if( prod2 != _producers2.end() ) {
-               const auto last_claim_plus_3days = pitr->last_claim_time + microseconds(3 * useconds_per_day);
-               bool crossed_threshold       = (last_claim_plus_3days <= ct);
-               bool updated_after_threshold = (last_claim_plus_3days <= prod2->last_votepay_share_update);
-               // Note: updated_after_threshold implies cross_threshold
-
-               double new_votepay_share = update_producer_votepay_share( prod2,
-                                             ct,
-                                             updated_after_threshold ? 0.0 : init_total_votes,
-                                             crossed_threshold && !updated_after_threshold // only reset votepay_share once after threshold
-                                          );
-
-               if( !crossed_threshold ) {
-                  delta_change_rate += pd.second.first;
-               } else if( !updated_after_threshold ) {
-                  total_inactive_vpay_share += new_votepay_share;
-                  delta_change_rate -= init_total_votes;
-               }
+            continue;
+         }
+
+         if( voting && !pitr->active() && pd.from_new_set ) {
+            check( false, ( "producer " + pitr->owner.to_string() + " is not currently registered" ).data() );
+         }
+         const bool has_votepay_share = merge_producer_votepay_share( *pitr );
+         const auto last_claim_plus_3days = pitr->last_claim_time + microseconds(3 * useconds_per_day);
+         bool crossed_threshold       = (last_claim_plus_3days <= ct);
+         bool updated_after_threshold = has_votepay_share && (last_claim_plus_3days <= pitr->last_votepay_share_update.value());
+         // Note: updated_after_threshold implies cross_threshold
+
+         double   init_total_votes  = pitr->total_votes;
+         int128_t new_votepay_share = 0;
+         _producers.modify( pitr, same_payer, [&]( auto& p ) {
+            p.total_votes += pd.delta;
+            if ( p.total_votes < 0 ) { // floating point arithmetics can give small negative numbers
+               p.total_votes = 0;
             }
-         } else {
-            if( pd.second.second ) {
-               check( false, ( "producer " + pd.first.to_string() + " is not registered" ).data() );
+            _gstate.modify().total_producer_vote_weight += pd.delta;
+            //check( p.total_votes >= 0, "something bad happened" );
+            if( has_votepay_share ) {
+               new_votepay_share = update_producer_votepay_share( p,
+                                      ct,
+                                      updated_after_threshold ? 0 : to_votepay_fixed( init_total_votes ),
+                                      crossed_threshold && !updated_after_threshold // only reset votepay_share once after threshold
+                                   );
+            }
+         });
+         update_schedule_candidate( *pitr );
+
+         if( has_votepay_share ) {
+            if( !crossed_threshold ) {
+               delta_change_rate += to_votepay_fixed( pd.delta );
+            } else if( !updated_after_threshold ) {
+               total_inactive_vpay_share += new_votepay_share;
+               delta_change_rate -= to_votepay_fixed( init_total_votes );
             }
          }
       }
@@ -353,11 +655,11 @@ namespace eosiosystem {
         const bool is_active_after = voter->is_active();
 
         if (!is_active_before && is_active_after) {
-          _gstate.active_stake += voter->staked;
+          add_active_stake( voter->staked );
         }
 
         if (is_active_before && !is_active_after) {
-          _gstate.active_stake -= voter->staked;
+          add_active_stake( -voter->staked );
         }
       }
    }
@@ -365,14 +667,11 @@ namespace eosiosystem {
    void system_contract::regproxy( const name& proxy, bool isproxy ) {
       require_auth( proxy );
 
-      auto pitr = _voters.find( proxy.value );
+      auto pitr = find_voter( proxy );
       if ( pitr != _voters.end() ) {
          check( isproxy != pitr->is_proxy, "action has no effect" );
          check( !isproxy || !pitr->proxy, "account that uses a proxy is not allowed to become a proxy" );
-         _voters.modify( pitr, same_payer, [&]( auto& p ) {
-               p.is_proxy = isproxy;
-            });
-         propagate_weight_change( *pitr );
+         propagate_weight_change( *pitr, 0.0, isproxy );
       } else {
          _voters.emplace( proxy, [&]( auto& p ) {
                p.owner = proxy;
@@ -381,63 +680,93 @@ namespace eosiosystem {
       }
    }
 
-   void system_contract::propagate_weight_change( const voter_info& voter ) {
-      check( !voter.proxy || !voter.is_proxy, "account registered as a proxy is not allowed to use a proxy" );
-      double new_weight = stake2vote( voter.staked );
-      if ( voter.is_proxy ) {
-         new_weight += voter.proxied_vote_weight;
-      }
-
-      /// don't propagate small changes (1 ~= epsilon)
-      if ( fabs( new_weight - voter.last_vote_weight ) > 1 ) {
-         if ( voter.proxy ) {
-            auto& proxy = _voters.get( voter.proxy.value, "proxy not found" ); //data corruption
-            _voters.modify( proxy, same_payer, [&]( auto& p ) {
-                  p.proxied_vote_weight += new_weight - voter.last_vote_weight;
-               }
-            );
-            propagate_weight_change( proxy );
-         } else {
-            auto delta = new_weight - voter.last_vote_weight;
-            const auto ct = current_time_point();
-            double delta_change_rate         = 0;
-            double total_inactive_vpay_share = 0;
-            for ( auto acnt : voter.producers ) {
-               auto& prod = _producers.get( acnt.value, "producer not found" ); //data corruption
-               const double init_total_votes = prod.total_votes;
-               _producers.modify( prod, same_payer, [&]( auto& p ) {
-                  p.total_votes += delta;
-                  _gstate.total_producer_vote_weight += delta;
-               });
-               auto prod2 = _producers2.find( acnt.value );
-               if ( prod2 != _producers2.end() ) {
-                  const auto last_claim_plus_3days = prod.last_claim_time + microseconds(3 * useconds_per_day);
-                  bool crossed_threshold       = (last_claim_plus_3days <= ct);
-                  bool updated_after_threshold = (last_claim_plus_3days <= prod2->last_votepay_share_update);
-                  // Note: updated_after_threshold implies cross_threshold
-
-                  double new_votepay_share = update_producer_votepay_share( prod2,
-                                                ct,
-                                                updated_after_threshold ? 0.0 : init_total_votes,
-                                                crossed_threshold && !updated_after_threshold // only reset votepay_share once after threshold
-                                             );
-
-                  if( !crossed_threshold ) {
-                     delta_change_rate += delta;
-                  } else if( !updated_after_threshold ) {
-                     total_inactive_vpay_share += new_votepay_share;
-                     delta_change_rate -= init_total_votes;
-                  }
-               }
+   /**
+    * Propagates a vote weight change of `voter` up its proxy chain and to the voted producers.
+    * `proxied_delta` is added to the voter's proxied weight and `is_proxy`, when set, replaces its proxy flag.
+    * New weights are computed before the rows are written, so every touched voter row is modified once.
+    */
+   void system_contract::propagate_weight_change( const voter_info& voter, double proxied_delta, std::optional<bool> is_proxy ) {
+      uint32_t voters_touched    = 0;
+      uint32_t producers_touched = 0;
+      const voter_info* current = &voter;
+      for( ;; ) {
+         check( voters_touched < max_proxy_chain_length, "proxy chain is too long" ); //data corruption
+         const bool current_is_proxy = is_proxy.value_or( current->is_proxy );
+         check( !current->proxy || !current_is_proxy, "account registered as a proxy is not allowed to use a proxy" );
+
+         const double proxied_vote_weight = current->proxied_vote_weight + proxied_delta;
+         double new_weight = stake2vote( current->staked );
+         if ( current_is_proxy ) {
+            new_weight += proxied_vote_weight;
+         }
+         const double delta = new_weight - current->last_vote_weight;
+
+         const voter_info* next = nullptr;
+         /// don't propagate small changes (1 ~= epsilon)
+         const bool propagate = fabs( delta ) > 1;
+         if ( propagate && current->proxy ) {
+            next = &get_voter( current->proxy, "proxy not found" ); //data corruption
+         } else if ( propagate ) {
+            apply_producers_vote_delta( current->producers, delta );
+            producers_touched = current->producers.size();
+         }
+
+         _voters.modify( *current, same_payer, [&]( auto& v ) {
+               v.proxied_vote_weight = proxied_vote_weight;
+               v.last_vote_weight    = new_weight;
+               v.is_proxy            = current_is_proxy;
             }
+         );
+         ++voters_touched;
 
-            update_total_votepay_share( ct, -total_inactive_vpay_share, delta_change_rate );
+         if ( !next ) {
+            break;
          }
+         current       = next;
+         proxied_delta = delta;
+         is_proxy.reset();
       }
-      _voters.modify( voter, same_payer, [&]( auto& v ) {
-            v.last_vote_weight = new_weight;
+      ADD_DEBUG_TRACE(debug_level::verbose, "propagated"_n, voters_touched, producers_touched);
+   }
+
+   void system_contract::apply_producers_vote_delta( const std::vector<name>& producers, double delta ) {
+      const auto ct = current_time_point();
+      int128_t delta_change_rate         = 0;
+      int128_t total_inactive_vpay_share = 0;
+      for ( auto acnt : producers ) {
+         auto& prod = _producers.get( acnt.value, "producer not found" ); //data corruption
+         const bool has_votepay_share = merge_producer_votepay_share( prod );
+         const auto last_claim_plus_3days = prod.last_claim_time + microseconds(3 * useconds_per_day);
+         bool crossed_threshold       = (last_claim_plus_3days <= ct);
+         bool updated_after_threshold = has_votepay_share && (last_claim_plus_3days <= prod.last_votepay_share_update.value());
+         // Note: updated_after_threshold implies cross_threshold
+
+         const double init_total_votes = prod.total_votes;
+         int128_t new_votepay_share    = 0;
+         _producers.modify( prod, same_payer, [&]( auto& p ) {
+            p.total_votes += delta;
+            _gstate.modify().total_producer_vote_weight += delta;
+            if ( has_votepay_share ) {
+               new_votepay_share = update_producer_votepay_share( p,
+                                      ct,
+                                      updated_after_threshold ? 0 : to_votepay_fixed( init_total_votes ),
+                                      crossed_threshold && !updated_after_threshold // only reset votepay_share once after threshold
+                                   );
+            }
+         });
+         update_schedule_candidate( prod );
+
+         if ( has_votepay_share ) {
+            if( !crossed_threshold ) {
+               delta_change_rate += to_votepay_fixed( delta );
+            } else if( !updated_after_threshold ) {
+               total_inactive_vpay_share += new_votepay_share;
+               delta_change_rate -= to_votepay_fixed( init_total_votes );
+            }
          }
-      );
+      }
+
+      update_total_votepay_share( ct, -total_inactive_vpay_share, delta_change_rate );
    }
 
 } /// namespace eosiosystem
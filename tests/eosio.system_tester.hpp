@@ -425,9 +425,32 @@ public:
       return abi_ser.binary_to_variant( "producer_info", data, abi_serializer_max_time );
    }
 
+   // vote pay shares and their change rates are 128-bit fixed point numbers, see `votepay_share_scale`
+   static double votepay_fixed_to_double( const fc::variant& v ) {
+      return std::stod( v.as_string() ) / (1ll << 16);
+   }
+
+   static __int128 votepay_fixed( const fc::variant& v ) {
+      __int128 result = 0;
+      for( char c : v.as_string() ) { // shares and rates are never negative
+         result = result * 10 + (c - '0');
+      }
+      return result;
+   }
+
+   // vote pay share fields are stored in the producers table, see `mergeprods` migration
    fc::variant get_producer_info2( const account_name& act ) {
-      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name, N(producers2), act );
-      return abi_ser.binary_to_variant( "producer_info2", data, abi_serializer_max_time );
+      return get_producer_info( act );
+   }
+
+   fc::variant get_schedule_candidate( const account_name& act ) {
+      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name, N(schedcands), act );
+      return data.empty() ? fc::variant() : abi_ser.binary_to_variant( "schedule_candidate", data, abi_serializer_max_time );
+   }
+
+   fc::variant get_refund_queue_item( const account_name& act ) {
+      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name, N(refundq), act );
+      return data.empty() ? fc::variant() : abi_ser.binary_to_variant( "refund_queue_item", data, abi_serializer_max_time );
    }
 
    fc::variant get_name_bid( const account_name& act ) const {
@@ -557,26 +580,96 @@ public:
    GET_GLOBAL_STATE_FUNC(get_global_state2, global2, eosio_global_state2)
    GET_GLOBAL_STATE_FUNC(get_global_state3, global3, eosio_global_state3)
    GET_GLOBAL_STATE_FUNC(get_global_state4, global4, eosio_global_state4)
+   GET_GLOBAL_STATE_FUNC(get_global_state5, global5, eosio_global_state5)
 
 #undef GET_GLOBAL_STATE_FUNC
 
+   /// Rewrites the binary data of a system contract row in scope `eosio`, bypassing the contract.
+   template<typename Update>
+   void modify_system_row( const name& table, uint64_t primary_key, Update&& update ) {
+      auto& db = control->mutable_db();
+      const auto* tbl = db.find<table_id_object, by_code_scope_table>(
+         boost::make_tuple( config::system_account_name, config::system_account_name, table ) );
+      BOOST_REQUIRE( tbl );
+      const auto* obj = db.find<key_value_object, by_scope_primary>( boost::make_tuple( tbl->id, primary_key ) );
+      BOOST_REQUIRE( obj );
+      db.modify( *obj, [&]( key_value_object& o ) {
+         std::vector<char> data( o.value.data(), o.value.data() + o.value.size() );
+         update( data );
+         o.value.assign( data.data(), data.size() );
+      });
+   }
+
+   /// Makes `global5` look as after upgrading from a version without the core supply snapshot and activated share.
+   void clear_core_supply_snapshot() {
+      modify_system_row( N(global5), N(global5).to_uint64_t(), []( std::vector<char>& data ) {
+         BOOST_REQUIRE_LE( 100u, data.size() );
+         // core_symbol and core_supply follow candidates_synced, last_proposed_schedule_hash and name_bids_indexed
+         std::fill( data.begin() + 34, data.begin() + 58, 0 );
+         // activated_share, activated_share_percent, emission_rate and continuous_rate follow vote weight fields,
+         // producers_merged and voters_upgraded
+         std::fill( data.begin() + 72, data.begin() + 100, 0 );
+      });
+   }
+
+   /// Appends the fields dropped by the compact encoding to the voter row and marks voters as not upgraded,
+   /// as if the row was stored by a previous contract version.
+   void make_legacy_voter_row( const account_name& act ) {
+      modify_system_row( N(voters), act.to_uint64_t(), []( std::vector<char>& data ) {
+         auto append = [&]( const auto& field ) {
+            const auto bytes = fc::raw::pack( field );
+            data.insert( data.end(), bytes.begin(), bytes.end() );
+         };
+         append( uint32_t(0) );                  // reserved2
+         append( asset( 0, symbol{CORE_SYM} ) ); // reserved3
+         append( true );                         // has_voted
+      });
+      modify_system_row( N(global5), N(global5).to_uint64_t(), []( std::vector<char>& data ) {
+         // voters_upgraded follows core supply, vote weight fields and producers_merged
+         BOOST_REQUIRE_LE( 72u, data.size() );
+         data[71] = 0;
+      });
+   }
+
+   /// Makes `global5` look as after upgrading from a version without the last proposed schedule hash.
+   void forget_last_proposed_schedule() {
+      modify_system_row( N(global5), N(global5).to_uint64_t(), []( std::vector<char>& data ) {
+         BOOST_REQUIRE_LE( 134u, data.size() );
+         // last_proposed_schedule_hash follows candidates_synced
+         std::fill( data.begin() + 1, data.begin() + 33, 0 );
+         // schedule_candidates_changed follows the votepay fields
+         data[133] = 1;
+      });
+   }
+
    fc::variant get_refund_request( name account ) {
       vector<char> data = get_row_by_account( config::system_account_name, account, N(refunds), account );
       return data.empty() ? fc::variant() : abi_ser.binary_to_variant( "refund_request", data, abi_serializer_max_time );
    }
 
 #ifdef DEBUG_MODE
-   fc::variant get_dlogs() const {
-      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name, N(dlogs), N(dlogs) );
-      return data.empty() ? fc::variant() : abi_ser.binary_to_variant( "dlogs", data, abi_serializer_max_time );
+   fc::variant get_debug_trace_state() const {
+      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name, N(dtracestate), N(dtracestate) );
+      return data.empty() ? fc::variant() : abi_ser.binary_to_variant( "debug_trace_state", data, abi_serializer_max_time );
+   }
+
+   fc::variant get_debug_trace( uint64_t seq ) const {
+      const uint64_t max_debug_traces = 256; // see eosio.system.hpp
+      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name, N(dtrace), account_name( seq % max_debug_traces ) );
+      return data.empty() ? fc::variant() : abi_ser.binary_to_variant( "debug_trace", data, abi_serializer_max_time );
    }
 #endif // DEBUG_MODE
 
    void print_debug_logs() const {
 #ifdef DEBUG_MODE
+      const uint64_t max_debug_traces = 256; // see eosio.system.hpp
+      const auto state = get_debug_trace_state();
+      const uint64_t next_seq = state.is_null() ? 0 : state["next_seq"].as<uint64_t>();
       std::string dlog;
-      for (const auto& log : get_dlogs()["data"].as<std::vector<std::string>>()) {
-         dlog += "  " + log + "\n";
+      for (uint64_t seq = next_seq > max_debug_traces ? next_seq - max_debug_traces : 0; seq < next_seq; ++seq) {
+         const auto trace = get_debug_trace(seq);
+         dlog += "  " + std::to_string(seq) + ": line " + trace["line"].as_string() + ": " + trace["event"].as_string()
+               + " " + trace["arg0"].as_string() + " " + trace["arg1"].as_string() + "\n";
       }
       BOOST_TEST_MESSAGE("debug log:\n" + dlog);
 #endif // DEBUG_MODE
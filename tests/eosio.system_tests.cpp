@@ -5,6 +5,7 @@
 #include <eosio/chain/global_property_object.hpp>
 #include <eosio/chain/resource_limits.hpp>
 #include <eosio/chain/wast_to_wasm.hpp>
+#include <eosio.system/ram_quote.hpp>
 #include <fc/log/logger.hpp>
 #include <wasm-jit/Runtime/Runtime.h>
 
@@ -12,6 +13,7 @@
 #include <boost/range/adaptor/transformed.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
 #include <sstream>
@@ -234,6 +236,237 @@ BOOST_FIXTURE_TEST_CASE( buysell, eosio_system_tester ) try {
 } FC_LOG_AND_RETHROW()
 
 
+// on-chain buyram/sellram/buyrambytes against the integer kernel for 64 pseudo-random amounts,
+// boundaries of the kernel are covered deterministically by ram_bancor_kernel_boundaries
+BOOST_FIXTURE_TEST_CASE( ram_bancor_integer_kernel_sampled, eosio_system_tester ) try {
+   auto get_reserves = [this]() {
+      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name,
+                                              N(rammarket), symbol{SY(4,RAMCORE)}.value() );
+      BOOST_REQUIRE( !data.empty() );
+      const auto market = abi_ser.binary_to_variant( "exchange_state", data, abi_serializer_max_time );
+      return std::make_pair( market["base"].as<connector>().balance.get_amount(),
+                             market["quote"].as<connector>().balance.get_amount() );
+   };
+   // floating point formula replaced by the integer kernel
+   auto float_bancor_output = []( int64_t inp_reserve, int64_t out_reserve, int64_t inp ) {
+      return int64_t( (double(inp) * out_reserve) / (double(inp_reserve) + inp) );
+   };
+
+   transfer( config::system_account_name, "alice1111111", STRSYM("100000000.0000"), config::system_account_name );
+
+   // payments from 1 to ~20000 tokens spread over all digit positions
+   uint64_t seed = 1;
+   for( int i = 0; i < 64; ++i ) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      const int64_t payment = 1'0000 + int64_t( (seed >> 33) % (1ull << (14 + i % 14)) );
+
+      const auto [ram0, core0] = get_reserves();
+      const uint64_t bytes0 = get_total_stake( "alice1111111" )["ram_bytes"].as_uint64();
+      BOOST_REQUIRE_EQUAL( success(), buyram( "alice1111111", "alice1111111", core_sym::from_int(payment) ) );
+      const int64_t  bought = get_total_stake( "alice1111111" )["ram_bytes"].as_uint64() - bytes0;
+
+      const int64_t net_payment = payment - (payment + 199) / 200;
+      BOOST_REQUIRE_EQUAL( eosiosystem::ram_quote::bytes_for_payment( ram0, core0, payment ), bought );
+      BOOST_REQUIRE( within_one( float_bancor_output( core0, ram0, net_payment ), bought ) );
+
+      // sell back a part of the bought bytes
+      const int64_t sold = std::max<int64_t>( bought / (1 + i % 3), 1 );
+      const auto [ram1, core1] = get_reserves();
+      const asset balance1 = get_balance( "alice1111111" );
+      BOOST_REQUIRE_EQUAL( success(), sellram( "alice1111111", sold ) );
+      const int64_t tokens_out = core1 - get_reserves().second;
+      BOOST_REQUIRE_EQUAL( eosiosystem::ram_quote::get_bancor_output( ram1, core1, sold ), tokens_out );
+      BOOST_REQUIRE( within_one( float_bancor_output( ram1, core1, sold ), tokens_out ) );
+      BOOST_REQUIRE_EQUAL( eosiosystem::ram_quote::proceeds_for_bytes( ram1, core1, sold ),
+                           (get_balance( "alice1111111" ) - balance1).get_amount() );
+   }
+
+   // buyrambytes charges what the quote says
+   const auto [ram0, core0] = get_reserves();
+   const asset balance0 = get_balance( "alice1111111" );
+   BOOST_REQUIRE_EQUAL( success(), buyrambytes( "alice1111111", "alice1111111", 4096 ) );
+   BOOST_REQUIRE_EQUAL( eosiosystem::ram_quote::payment_for_bytes( ram0, core0, 4096 ),
+                        (balance0 - get_balance( "alice1111111" )).get_amount() );
+} FC_LOG_AND_RETHROW()
+
+
+BOOST_AUTO_TEST_CASE( ram_bancor_kernel_boundaries ) try {
+   using namespace eosiosystem::ram_quote;
+   constexpr int64_t max = std::numeric_limits<int64_t>::max();
+
+   // tiny, market sized, double precision limit and huge reserves
+   const vector<int64_t> reserves = { 1, 2, 3, 7, 1000, 1'000'000'007, int64_t(1) << 40, (int64_t(1) << 53) + 1,
+                                      int64_t(1) << 62, max - 1, max };
+   // the old float formulas, within one unit of the kernel while doubles are exact, relatively close beyond
+   auto near_float = []( int64_t exact, double fp ) {
+      return std::fabs( fp - double(exact) ) <= double(exact) * std::ldexp( 1., -50 ) + 1.;
+   };
+
+   for( const int64_t ib : reserves ) {
+      for( const int64_t ob : reserves ) {
+         // output of paying any amount, including the whole reserve or more, is the exact quotient rounded down
+         for( const int64_t in : reserves ) {
+            for( const int64_t inp : { in - 1, in } ) {
+               const int64_t out = get_bancor_output( ib, ob, inp );
+               const __int128 num = __int128(inp) * ob;
+               const __int128 den = __int128(ib) + inp;
+               BOOST_REQUIRE( out >= 0 && out < ob );
+               BOOST_REQUIRE( __int128(out) * den <= num && num < (__int128(out) + 1) * den );
+               BOOST_REQUIRE( near_float( out, (double(inp) * ob) / (double(ib) + inp) ) );
+            }
+         }
+
+         // input for taking 0, 1, half, or all but one or two units of the output reserve
+         for( const int64_t out : { int64_t(0), int64_t(1), ob / 2, ob - 2, ob - 1 } ) {
+            if( out < 0 || out >= ob ) continue;
+            const int64_t inp = get_bancor_input( ob, ib, out );
+            const __int128 num = __int128(ib) * out;
+            const __int128 den = __int128(ob) - out;
+            if( num / den > max ) {
+               BOOST_REQUIRE_EQUAL( no_quote, inp );
+               continue;
+            }
+            BOOST_REQUIRE( inp >= 0 );
+            BOOST_REQUIRE( __int128(inp) * den <= num && num < (__int128(inp) + 1) * den );
+            // rounding down the price never gives more than asked, one more unit never gives less
+            BOOST_REQUIRE( get_bancor_output( ib, ob, inp ) <= out );
+            if( inp < max ) {
+               BOOST_REQUIRE( get_bancor_output( ib, ob, inp + 1 ) >= out );
+            }
+            // where ob - out cancels in double the old formula had no meaningful result to compare with
+            if( double(ob) - double(out) == double(ob - out) ) {
+               BOOST_REQUIRE( near_float( inp, (double(ib) * out) / (double(ob) - out) ) );
+            }
+         }
+      }
+   }
+} FC_LOG_AND_RETHROW()
+
+
+BOOST_AUTO_TEST_CASE( ram_quote_domain ) try {
+   using namespace eosiosystem::ram_quote;
+   constexpr int64_t max = std::numeric_limits<int64_t>::max();
+
+   // buying the whole reserve or more has no price
+   BOOST_REQUIRE_EQUAL( no_quote, get_bancor_input( 1000, 1000, 1000 ) );
+   BOOST_REQUIRE_EQUAL( no_quote, get_bancor_input( 1000, 1000, 1001 ) );
+   BOOST_REQUIRE_EQUAL( no_quote, get_bancor_input( 1000, 1000, max ) );
+   BOOST_REQUIRE_EQUAL( 999000, get_bancor_input( 1000, 1000, 999 ) );
+   BOOST_REQUIRE_EQUAL( no_quote, payment_for_bytes( 1000, 1000, 1000 ) );
+   BOOST_REQUIRE_EQUAL( no_quote, payment_for_bytes( 1000, 1000, 1001 ) );
+   BOOST_REQUIRE_EQUAL( 1004020, payment_for_bytes( 1000, 1000, 999 ) ); // 999000 / 0.995 rounded down
+
+   // reserves must be positive, amounts non-negative
+   for( const int64_t bad : { int64_t(0), int64_t(-1), std::numeric_limits<int64_t>::min() } ) {
+      BOOST_REQUIRE_EQUAL( no_quote, get_bancor_input( bad, 1000, 0 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, get_bancor_input( 1000, bad, 1 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, get_bancor_output( bad, 1000, 1 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, get_bancor_output( 1000, bad, 1 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, payment_for_bytes( bad, 1000, 0 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, payment_for_bytes( 1000, bad, 1 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, bytes_for_payment( bad, 1000, 1 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, bytes_for_payment( 1000, bad, 1 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, proceeds_for_bytes( bad, 1000, 1 ) );
+      BOOST_REQUIRE_EQUAL( no_quote, proceeds_for_bytes( 1000, bad, 1 ) );
+   }
+   BOOST_REQUIRE_EQUAL( no_quote, get_bancor_input( 1000, 1000, -1 ) );
+   BOOST_REQUIRE_EQUAL( no_quote, get_bancor_output( 1000, 1000, -1 ) );
+   BOOST_REQUIRE_EQUAL( no_quote, bytes_for_payment( 1000, 1000, -1 ) );
+   BOOST_REQUIRE_EQUAL( no_quote, proceeds_for_bytes( 1000, 1000, -1 ) );
+
+   // tiny amounts round down to nothing, the fee of a single unit takes all of it
+   BOOST_REQUIRE_EQUAL( 0, get_fee( 0 ) );
+   BOOST_REQUIRE_EQUAL( 1, get_fee( 1 ) );
+   BOOST_REQUIRE_EQUAL( 0, get_bancor_input( 1000, 1000, 0 ) );
+   BOOST_REQUIRE_EQUAL( 0, get_bancor_output( 1000, 1000, 0 ) );
+   BOOST_REQUIRE_EQUAL( 0, payment_for_bytes( 1000, 1000, 0 ) );
+   BOOST_REQUIRE_EQUAL( 0, bytes_for_payment( 1000, 1000, 0 ) );
+   BOOST_REQUIRE_EQUAL( 0, bytes_for_payment( 1000, 1000, 1 ) );
+   BOOST_REQUIRE_EQUAL( 0, bytes_for_payment( 1000, 1000, 2 ) ); // 1 unit after fee buys 1000/1001 bytes
+   BOOST_REQUIRE_EQUAL( 0, proceeds_for_bytes( 1000, 1000, 1 ) );
+   BOOST_REQUIRE_EQUAL( 0, get_bancor_input( 1000, 1, 1 ) );       // 1/999 of a unit
+   BOOST_REQUIRE_EQUAL( 1, payment_for_bytes( 1'000'000, 1'000'000, 1 ) );
+
+   // prices that do not fit int64_t have no quote either
+   BOOST_REQUIRE_EQUAL( no_quote, get_bancor_input( max, max, max - 1 ) );
+   BOOST_REQUIRE_EQUAL( max, get_bancor_input( 2, max, 1 ) );
+   BOOST_REQUIRE_EQUAL( no_quote, payment_for_bytes( 2, max, 1 ) );
+   BOOST_REQUIRE_EQUAL( max - 1, get_bancor_output( 1, max, max ) ); // never the whole reserve
+} FC_LOG_AND_RETHROW()
+
+
+BOOST_FIXTURE_TEST_CASE( buy_ram_batch, eosio_system_tester ) try {
+   auto get_reserves = [this]() {
+      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name,
+                                              N(rammarket), symbol{SY(4,RAMCORE)}.value() );
+      BOOST_REQUIRE( !data.empty() );
+      const auto market = abi_ser.binary_to_variant( "exchange_state", data, abi_serializer_max_time );
+      return std::make_pair( market["base"].as<connector>().balance.get_amount(),
+                             market["quote"].as<connector>().balance.get_amount() );
+   };
+   auto purchase = []( name receiver, const asset& quant ) {
+      return mvo()("receiver", receiver)("quant", quant);
+   };
+
+   transfer( config::system_account_name, "alice1111111", STRSYM("10000.0000"), config::system_account_name );
+
+   const vector<std::pair<name, int64_t>> purchases = {
+      { N(bob111111111), 10'0000 }, { N(carol1111111), 25'5555 }, { N(bob111111111), 1'0001 }, { N(alice1111111), 300'0000 }
+   };
+   vector<mvo> actions;
+   std::map<name, int64_t> expected_bytes;
+   int64_t total = 0, total_fee = 0;
+   auto [ram, core] = get_reserves();
+   for( const auto& [receiver, amount] : purchases ) {
+      actions.push_back( purchase( receiver, core_sym::from_int(amount) ) );
+      if( !expected_bytes.count( receiver ) ) {
+         expected_bytes[receiver] = get_total_stake( receiver )["ram_bytes"].as_int64();
+      }
+      // each purchase moves the market before the next one, exactly as a sequence of buyram
+      const int64_t bytes = eosiosystem::ram_quote::bytes_for_payment( ram, core, amount );
+      const int64_t fee = eosiosystem::ram_quote::get_fee( amount );
+      expected_bytes[receiver] += bytes;
+      ram  -= bytes;
+      core += amount - fee;
+      total += amount;
+      total_fee += fee;
+   }
+
+   const asset alice_balance = get_balance( "alice1111111" );
+   const asset ramfee_balance = get_balance( N(eosio.ramfee) );
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(buyrambatch), mvo()
+                                                ("payer", "alice1111111")
+                                                ("purchases", actions) ) );
+
+   BOOST_REQUIRE( std::make_pair( ram, core ) == get_reserves() );
+   for( const auto& [receiver, bytes] : expected_bytes ) {
+      BOOST_REQUIRE_EQUAL( bytes, get_total_stake( receiver )["ram_bytes"].as_int64() );
+      int64_t ram_limit, net, cpu;
+      control->get_resource_limits_manager().get_account_limits( receiver, ram_limit, net, cpu );
+      BOOST_REQUIRE_EQUAL( bytes + 1400, ram_limit ); // ram_gift_bytes
+   }
+   BOOST_REQUIRE_EQUAL( core_sym::from_int(total), alice_balance - get_balance( "alice1111111" ) );
+   BOOST_REQUIRE_EQUAL( core_sym::from_int(total_fee), get_balance( N(eosio.ramfee) ) - ramfee_balance );
+
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("no ram purchases"),
+                        push_action( N(alice1111111), N(buyrambatch), mvo()
+                                     ("payer", "alice1111111")
+                                     ("purchases", vector<mvo>{}) ) );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("must purchase a positive amount"),
+                        push_action( N(alice1111111), N(buyrambatch), mvo()
+                                     ("payer", "alice1111111")
+                                     ("purchases", vector<mvo>{ purchase( N(bob111111111), STRSYM("1.0000") ),
+                                                                purchase( N(carol1111111), STRSYM("0.0000") ) }) ) );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("must buy ram with core token"),
+                        push_action( N(alice1111111), N(buyrambatch), mvo()
+                                     ("payer", "alice1111111")
+                                     ("purchases", vector<mvo>{ purchase( N(bob111111111), asset::from_string("1.0000 OTHER") ) }) ) );
+   BOOST_REQUIRE_EQUAL( error("missing authority of alice1111111"),
+                        push_action( N(bob111111111), N(buyrambatch), mvo()
+                                     ("payer", "alice1111111")
+                                     ("purchases", vector<mvo>{ purchase( N(bob111111111), STRSYM("1.0000") ) }) ) );
+} FC_LOG_AND_RETHROW()
+
 BOOST_FIXTURE_TEST_CASE( stake_unstake, eosio_system_tester ) try {
    cross_15_percent_threshold();
 
@@ -426,6 +659,144 @@ BOOST_FIXTURE_TEST_CASE( stake_while_pending_refund, eosio_system_tester ) try {
 } FC_LOG_AND_RETHROW()
 
 
+BOOST_FIXTURE_TEST_CASE( refunds_paid_by_onblock, eosio_system_tester ) try {
+   cross_15_percent_threshold();
+
+   const size_t max_refunds_per_block = 10; // see eosio.system.hpp
+   std::vector<account_name> accounts;
+   for( char c = 'a'; c <= 'x'; ++c ) {
+      accounts.push_back( account_name( std::string("refunder") + c ) );
+   }
+   create_accounts_with_resources( accounts );
+   for( const auto& a : accounts ) {
+      issue_and_transfer( a, STRSYM("100.0000"), config::system_account_name );
+      BOOST_REQUIRE_EQUAL( success(), stake( a, STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("10.0000") ) );
+   }
+   produce_blocks(1);
+   for( const auto& a : accounts ) {
+      BOOST_REQUIRE_EQUAL( success(), unstake( a, STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("10.0000") ) );
+      BOOST_REQUIRE_EQUAL( false, get_refund_queue_item( a ).is_null() );
+   }
+
+   // stake taken back from the refund leaves the queue
+   BOOST_REQUIRE_EQUAL( success(), stake( accounts.back(), STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("10.0000") ) );
+   BOOST_REQUIRE_EQUAL( true, get_refund_queue_item( accounts.back() ).is_null() );
+   BOOST_REQUIRE_EQUAL( true, get_refund_request( accounts.back() ).is_null() );
+   accounts.pop_back();
+
+   produce_blocks(1);
+   produce_block( fc::days(14) );
+
+   // every block pays a limited number of refunds ...
+   auto count_paid = [&]() {
+      size_t paid = 0;
+      for( const auto& a : accounts ) {
+         if( get_refund_request( a ).is_null() ) {
+            BOOST_REQUIRE_EQUAL( true, get_refund_queue_item( a ).is_null() );
+            BOOST_REQUIRE_EQUAL( STRSYM("100.0000"), get_balance( a ) );
+            ++paid;
+         }
+      }
+      return paid;
+   };
+   const size_t paid = count_paid();
+   BOOST_REQUIRE( 0 < paid && paid < accounts.size() );
+   BOOST_REQUIRE_EQUAL( 0u, paid % max_refunds_per_block );
+
+   // ... the rest is paid by the next ones, unless claimed
+   const auto last = accounts.back();
+   BOOST_REQUIRE_EQUAL( false, get_refund_queue_item( last ).is_null() );
+   BOOST_REQUIRE_EQUAL( success(), push_action( last, N(refund), mvo()("owner", last) ) );
+   BOOST_REQUIRE_EQUAL( true, get_refund_queue_item( last ).is_null() );
+   BOOST_REQUIRE_EQUAL( STRSYM("100.0000"), get_balance( last ) );
+
+   produce_blocks( accounts.size() / max_refunds_per_block );
+   BOOST_REQUIRE_EQUAL( accounts.size(), count_paid() );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( rejected_refund_does_not_stop_onblock, eosio_system_tester ) try {
+   cross_15_percent_threshold();
+
+   create_account_with_resources( N(refunderrej), config::system_account_name, 20000 );
+   create_account_with_resources( N(refunderok), config::system_account_name );
+   for( const auto& a : { N(refunderrej), N(refunderok) } ) {
+      issue_and_transfer( a, STRSYM("100.0000"), config::system_account_name );
+      BOOST_REQUIRE_EQUAL( success(), stake( a, STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("10.0000") ) );
+      BOOST_REQUIRE_EQUAL( success(), unstake( a, STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("10.0000") ) );
+   }
+   // the first matured refund goes to an account with code rejecting the transfer notification
+   set_code( N(refunderrej), contracts::util::reject_all_wasm() );
+   produce_blocks(1);
+   produce_block( fc::days(14) );
+   produce_blocks(1);
+
+   // accounts with code are not paid by onblock, their refund request stays claimable
+   BOOST_REQUIRE_EQUAL( true, get_refund_queue_item( N(refunderrej) ).is_null() );
+   BOOST_REQUIRE_EQUAL( false, get_refund_request( N(refunderrej) ).is_null() );
+   BOOST_REQUIRE_EQUAL( STRSYM("70.0000"), get_balance( N(refunderrej) ) );
+   BOOST_REQUIRE_EQUAL( true, get_refund_request( N(refunderok) ).is_null() );
+   BOOST_REQUIRE_EQUAL( STRSYM("100.0000"), get_balance( N(refunderok) ) );
+
+   // onblock keeps running and updating the producer schedule
+   for( int i = 0; i < 3; ++i ) {
+      const auto last_update = get_global_state()["last_producer_schedule_update"].as<block_timestamp_type>();
+      produce_block( fc::minutes(2) );
+      produce_blocks(1);
+      BOOST_REQUIRE( last_update < get_global_state()["last_producer_schedule_update"].as<block_timestamp_type>() );
+   }
+   BOOST_REQUIRE_EQUAL( false, get_refund_request( N(refunderrej) ).is_null() );
+
+   // the owner claims it once the transfer is accepted
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("rejecting all notifications"),
+                        push_action( N(refunderrej), N(refund), mvo()("owner", "refunderrej") ) );
+   set_code( N(refunderrej), std::vector<uint8_t>{} );
+   produce_blocks(1);
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(refunderrej), N(refund), mvo()("owner", "refunderrej") ) );
+   BOOST_REQUIRE_EQUAL( true, get_refund_request( N(refunderrej) ).is_null() );
+   BOOST_REQUIRE_EQUAL( STRSYM("100.0000"), get_balance( N(refunderrej) ) );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( rejected_reward_issue_does_not_stop_onblock, eosio_system_tester ) try {
+   cross_15_percent_threshold();
+   produce_blocks(2); // start the presses
+
+   // the DAO transfer of the issued inflation is rejected
+   set_code( N(eosio.saving), contracts::util::reject_all_wasm() );
+   produce_blocks(1);
+   const asset supply = get_token_supply();
+
+   // onblock keeps accruing the inflation and updating the producer schedule
+   for( int i = 0; i < 3; ++i ) {
+      const auto last_update = get_global_state()["last_producer_schedule_update"].as<block_timestamp_type>();
+      const auto last_fill   = get_global_state()["last_pervote_bucket_fill"].as<fc::time_point>();
+      produce_block( fc::hours(1) );
+      produce_blocks(1);
+      BOOST_REQUIRE( last_update < get_global_state()["last_producer_schedule_update"].as<block_timestamp_type>() );
+      BOOST_REQUIRE( last_fill < get_global_state()["last_pervote_bucket_fill"].as<fc::time_point>() );
+   }
+   const auto gstate5 = get_global_state5();
+   const int64_t to_dao = gstate5["unissued_dao"].as<int64_t>();
+   const int64_t unissued = to_dao + gstate5["unissued_perblock"].as<int64_t>() + gstate5["unissued_pervote"].as<int64_t>();
+   BOOST_REQUIRE_LT( 0, to_dao );
+   BOOST_REQUIRE_EQUAL( supply, get_token_supply() );
+   BOOST_REQUIRE_EQUAL( supply + asset( unissued, supply.get_symbol() ), gstate5["core_supply"].as<asset>() );
+   BOOST_REQUIRE_EQUAL( gstate5["unissued_perblock"].as<int64_t>(), get_global_state()["perblock_bucket"].as<int64_t>() );
+   BOOST_REQUIRE_EQUAL( gstate5["unissued_pervote"].as<int64_t>(), get_global_state()["pervote_bucket"].as<int64_t>() );
+
+   // only the issue fails
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("rejecting all notifications"),
+                        push_action( N(alice1111111), N(fillrewards), mvo() ) );
+
+   // and it succeeds with everything accrued once the transfer is accepted
+   set_code( N(eosio.saving), std::vector<uint8_t>{} );
+   produce_blocks(1);
+   const asset saving = get_balance( N(eosio.saving) );
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(fillrewards), mvo() ) );
+   BOOST_REQUIRE_EQUAL( supply + asset( unissued, supply.get_symbol() ), get_token_supply() );
+   BOOST_REQUIRE_EQUAL( saving + asset( to_dao, supply.get_symbol() ), get_balance( N(eosio.saving) ) );
+   BOOST_REQUIRE_EQUAL( 0, get_global_state5()["unissued_dao"].as<int64_t>() );
+} FC_LOG_AND_RETHROW()
+
 BOOST_FIXTURE_TEST_CASE( fail_without_auth, eosio_system_tester ) try {
    cross_15_percent_threshold();
 
@@ -855,6 +1226,157 @@ BOOST_FIXTURE_TEST_CASE( stake_to_another_user_not_from_refund, eosio_system_tes
 } FC_LOG_AND_RETHROW()
 
 
+BOOST_FIXTURE_TEST_CASE( stake_to_another_user_not_from_refund_batch, eosio_system_tester ) try {
+   cross_15_percent_threshold();
+
+   issue_and_transfer( "alice1111111", STRSYM("1000.0000"),  config::system_account_name );
+   BOOST_REQUIRE_EQUAL( success(), stake( "alice1111111", STRSYM("200.0000"), STRSYM("100.0000"), STRSYM("100.0000") ) );
+   BOOST_REQUIRE_EQUAL( success(), unstake( "alice1111111", STRSYM("150.0000"), STRSYM("50.0000"), STRSYM("50.0000") ) );
+   BOOST_REQUIRE_EQUAL( STRSYM("600.0000"), get_balance( "alice1111111" ) );
+
+   auto delta = []( name receiver, const asset& net, const asset& cpu, const asset& vote ) {
+      return mvo()("receiver", receiver)("net_delta", net)("cpu_delta", cpu)("vote_delta", vote);
+   };
+   auto check_refund = [&]( const asset& net, const asset& cpu, const asset& vote ) {
+      const auto refund = get_refund_request( "alice1111111" );
+      BOOST_REQUIRE_EQUAL( net,  refund["net_amount"].as<asset>() );
+      BOOST_REQUIRE_EQUAL( cpu,  refund["cpu_amount"].as<asset>() );
+      BOOST_REQUIRE_EQUAL( vote, refund["vote_amount"].as<asset>() );
+   };
+   check_refund( STRSYM("150.0000"), STRSYM("50.0000"), STRSYM("50.0000") );
+
+   // stake to another user is taken from alice's balance, refund request stays the same
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(changebwmany), mvo()
+                                                ("from", "alice1111111")
+                                                ("deltas", vector<mvo>{
+                                                   delta( N(bob111111111), STRSYM("100.0000"), STRSYM("50.0000"), STRSYM("0.0000") ),
+                                                   delta( N(carol1111111), STRSYM("10.0000"), STRSYM("0.0000"), STRSYM("0.0000") )
+                                                }) ) );
+   BOOST_REQUIRE_EQUAL( STRSYM("440.0000"), get_balance( "alice1111111" ) );
+   check_refund( STRSYM("150.0000"), STRSYM("50.0000"), STRSYM("50.0000") );
+   BOOST_REQUIRE_EQUAL( STRSYM("110.0000"), get_total_stake( "bob111111111" )["net_weight"].as<asset>() );
+   BOOST_REQUIRE_EQUAL( STRSYM("60.0000"), get_total_stake( "bob111111111" )["cpu_weight"].as<asset>() );
+
+   // tokens unstaked in the same batch go to the refund request, they do not pay for stake to another user
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(changebwmany), mvo()
+                                                ("from", "alice1111111")
+                                                ("deltas", vector<mvo>{
+                                                   delta( N(alice1111111), STRSYM("-20.0000"), STRSYM("0.0000"), STRSYM("0.0000") ),
+                                                   delta( N(bob111111111), STRSYM("0.0000"), STRSYM("30.0000"), STRSYM("0.0000") )
+                                                }) ) );
+   BOOST_REQUIRE_EQUAL( STRSYM("410.0000"), get_balance( "alice1111111" ) );
+   check_refund( STRSYM("170.0000"), STRSYM("50.0000"), STRSYM("50.0000") );
+   BOOST_REQUIRE_EQUAL( STRSYM("90.0000"), get_total_stake( "bob111111111" )["cpu_weight"].as<asset>() );
+
+   // nor do tokens unstaked from another user
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(changebwmany), mvo()
+                                                ("from", "alice1111111")
+                                                ("deltas", vector<mvo>{
+                                                   delta( N(bob111111111), STRSYM("-40.0000"), STRSYM("0.0000"), STRSYM("0.0000") ),
+                                                   delta( N(carol1111111), STRSYM("0.0000"), STRSYM("40.0000"), STRSYM("0.0000") )
+                                                }) ) );
+   BOOST_REQUIRE_EQUAL( STRSYM("370.0000"), get_balance( "alice1111111" ) );
+   check_refund( STRSYM("210.0000"), STRSYM("50.0000"), STRSYM("50.0000") );
+} FC_LOG_AND_RETHROW()
+
+
+BOOST_FIXTURE_TEST_CASE( stake_and_vote_batch, eosio_system_tester ) try {
+   issue_and_transfer( "alice1111111", STRSYM("1000.0000"),  config::system_account_name );
+   create_accounts_with_resources( { N(defproducer1) } );
+   BOOST_REQUIRE_EQUAL( success(), regproducer( "defproducer1" ) );
+
+   auto request = []( name receiver, const asset& net, const asset& cpu, const asset& vote, const vector<name>& producers ) {
+      return mvo()("receiver", receiver)("stake_net_quantity", net)("stake_cpu_quantity", cpu)
+                  ("stake_vote_quantity", vote)("producers", producers);
+   };
+
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("vote can only be transfered or delegated to yourself"),
+                        push_action( N(alice1111111), N(stakevote), mvo()
+                                     ("from", "alice1111111")
+                                     ("requests", vector<mvo>{ request( N(bob111111111), STRSYM("1.0000"), STRSYM("1.0000"), STRSYM("1.0000"), {} ) })
+                                     ("transfer", false) ) );
+
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(stakevote), mvo()
+                                                ("from", "alice1111111")
+                                                ("requests", vector<mvo>{
+                                                   request( N(alice1111111), STRSYM("100.0000"), STRSYM("50.0000"), STRSYM("300.0000"), { N(defproducer1) } ),
+                                                   request( N(bob111111111), STRSYM("20.0000"), STRSYM("10.0000"), STRSYM("0.0000"), {} )
+                                                })
+                                                ("transfer", false) ) );
+
+   BOOST_REQUIRE_EQUAL( STRSYM("520.0000"), get_balance( "alice1111111" ) );
+   auto total = get_total_stake( "alice1111111" );
+   BOOST_REQUIRE_EQUAL( STRSYM("110.0000"), total["net_weight"].as<asset>());
+   BOOST_REQUIRE_EQUAL( STRSYM("60.0000"), total["cpu_weight"].as<asset>());
+   BOOST_REQUIRE_EQUAL( STRSYM("300.0000"), total["vote_weight"].as<asset>());
+   total = get_total_stake( "bob111111111" );
+   BOOST_REQUIRE_EQUAL( STRSYM("30.0000"), total["net_weight"].as<asset>());
+   BOOST_REQUIRE_EQUAL( STRSYM("20.0000"), total["cpu_weight"].as<asset>());
+
+   auto voter = get_voter_info( "alice1111111" );
+   BOOST_REQUIRE_EQUAL( STRSYM("300.0000").get_amount(), voter["staked"].as<int64_t>() );
+   BOOST_REQUIRE( fc::variants{ fc::variant(N(defproducer1)) } == voter["producers"].get_array() );
+
+   // voting on behalf of another receiver requires its authority
+   BOOST_REQUIRE_EQUAL( error("missing authority of bob111111111"),
+                        push_action( N(alice1111111), N(stakevote), mvo()
+                                     ("from", "alice1111111")
+                                     ("requests", vector<mvo>{ request( N(bob111111111), STRSYM("1.0000"), STRSYM("1.0000"), STRSYM("1.0000"), { N(defproducer1) } ) })
+                                     ("transfer", true) ) );
+} FC_LOG_AND_RETHROW()
+
+
+BOOST_FIXTURE_TEST_CASE( change_bandwidth_batch, eosio_system_tester ) try {
+   cross_15_percent_threshold();
+
+   issue_and_transfer( "alice1111111", STRSYM("1000.0000"),  config::system_account_name );
+   BOOST_REQUIRE_EQUAL( success(), stake( "alice1111111", STRSYM("100.0000"), STRSYM("100.0000"), STRSYM("100.0000") ) );
+   BOOST_REQUIRE_EQUAL( success(), stake( "alice1111111", "bob111111111", STRSYM("100.0000"), STRSYM("0.0000"), STRSYM("0.0000") ) );
+   BOOST_REQUIRE_EQUAL( STRSYM("600.0000"), get_balance( "alice1111111" ) );
+
+   auto delta = []( name receiver, const asset& net, const asset& cpu, const asset& vote ) {
+      return mvo()("receiver", receiver)("net_delta", net)("cpu_delta", cpu)("vote_delta", vote);
+   };
+
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("vote can only be delegated to yourself"),
+                        push_action( N(alice1111111), N(changebwmany), mvo()
+                                     ("from", "alice1111111")
+                                     ("deltas", vector<mvo>{ delta( N(bob111111111), STRSYM("0.0000"), STRSYM("0.0000"), STRSYM("1.0000") ) }) ) );
+
+   // tokens unstaked from bob are staked to alice, nothing is transfered or refunded
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(changebwmany), mvo()
+                                                ("from", "alice1111111")
+                                                ("deltas", vector<mvo>{
+                                                   delta( N(bob111111111), STRSYM("-50.0000"), STRSYM("0.0000"), STRSYM("0.0000") ),
+                                                   delta( N(alice1111111), STRSYM("0.0000"), STRSYM("20.0000"), STRSYM("30.0000") )
+                                                }) ) );
+   BOOST_REQUIRE_EQUAL( STRSYM("600.0000"), get_balance( "alice1111111" ) );
+   BOOST_REQUIRE_EQUAL( true, get_refund_request( "alice1111111" ).is_null() );
+   auto total = get_total_stake( "alice1111111" );
+   BOOST_REQUIRE_EQUAL( STRSYM("130.0000"), total["cpu_weight"].as<asset>());
+   BOOST_REQUIRE_EQUAL( STRSYM("130.0000"), total["vote_weight"].as<asset>());
+   BOOST_REQUIRE_EQUAL( STRSYM("60.0000"), get_total_stake( "bob111111111" )["net_weight"].as<asset>());
+   BOOST_REQUIRE_EQUAL( STRSYM("130.0000").get_amount(), get_voter_info( "alice1111111" )["staked"].as<int64_t>() );
+
+   // only the difference is refunded
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(changebwmany), mvo()
+                                                ("from", "alice1111111")
+                                                ("deltas", vector<mvo>{
+                                                   delta( N(bob111111111), STRSYM("-50.0000"), STRSYM("0.0000"), STRSYM("0.0000") ),
+                                                   delta( N(alice1111111), STRSYM("10.0000"), STRSYM("0.0000"), STRSYM("0.0000") )
+                                                }) ) );
+   auto refund = get_refund_request( "alice1111111" );
+   BOOST_REQUIRE_EQUAL( STRSYM("40.0000"), refund["net_amount"].as<asset>() );
+   BOOST_REQUIRE_EQUAL( STRSYM("0.0000"), refund["cpu_amount"].as<asset>() );
+   BOOST_REQUIRE_EQUAL( STRSYM("0.0000"), refund["vote_amount"].as<asset>() );
+   BOOST_REQUIRE_EQUAL( STRSYM("600.0000"), get_balance( "alice1111111" ) );
+
+   produce_block( fc::hours(3*24) );
+   produce_blocks(1);
+   BOOST_REQUIRE_EQUAL( STRSYM("640.0000"), get_balance( "alice1111111" ) );
+} FC_LOG_AND_RETHROW()
+
+
 // Tests for voting
 BOOST_FIXTURE_TEST_CASE( producer_register_unregister, eosio_system_tester ) try {
    issue_and_transfer( "alice1111111", STRSYM("1000.0000"),  config::system_account_name );
@@ -1393,76 +1915,73 @@ BOOST_FIXTURE_TEST_CASE(producer_pay, eosio_system_tester, * boost::unit_test::t
       produce_blocks(50);
 
       const auto     initial_global_state      = get_global_state();
-      const uint64_t initial_claim_time        = microseconds_since_epoch_of_iso_string( initial_global_state["last_pervote_bucket_fill"] );
+      const uint64_t initial_fill_time         = microseconds_since_epoch_of_iso_string( initial_global_state["last_pervote_bucket_fill"] );
       const int64_t  initial_pervote_bucket    = initial_global_state["pervote_bucket"].as<int64_t>();
       const int64_t  initial_perblock_bucket   = initial_global_state["perblock_bucket"].as<int64_t>();
       const int64_t  initial_dao               = get_balance(N(eosio.saving)).get_amount(); // DAOBET
-      const uint32_t initial_tot_unpaid_blocks = initial_global_state["total_unpaid_blocks"].as<uint32_t>();
 
       wdump((initial_global_state));
       wdump((get_producer_info(N(defproducera))));
       print_debug_logs();
 
-      prod = get_producer_info("defproducera");
-      const uint32_t unpaid_blocks = prod["unpaid_blocks"].as<uint32_t>();
-      BOOST_REQUIRE_GT(unpaid_blocks, 1);
-
-      BOOST_REQUIRE_EQUAL(initial_tot_unpaid_blocks, unpaid_blocks);
-
       const asset initial_supply  = get_token_supply();
-      const asset initial_balance = get_balance(N(defproducera));
       const double emission_rate = get_target_emission_rate_per_year(1.0 * initial_global_state["total_activated_stake"].as<int64_t>() / initial_supply.get_amount());
       const double continuous_rate = get_continuous_rate(emission_rate);
 
-      BOOST_REQUIRE_EQUAL(success(), push_action(N(defproducera), N(claimrewards), mvo()("owner", "defproducera")));
+      // inflation is accrued by the first onblock after the reward fill interval and issued by fillrewards
+      produce_block(fc::hours(1));
+      BOOST_REQUIRE_EQUAL(success(), push_action(N(defproducera), N(fillrewards), mvo()));
 
       const auto     global_state      = get_global_state();
-      const uint64_t claim_time        = microseconds_since_epoch_of_iso_string( global_state["last_pervote_bucket_fill"] );
+      const uint64_t fill_time         = microseconds_since_epoch_of_iso_string( global_state["last_pervote_bucket_fill"] );
       const int64_t  pervote_bucket    = global_state["pervote_bucket"].as<int64_t>();
       const int64_t  perblock_bucket   = global_state["perblock_bucket"].as<int64_t>();
       const int64_t  dao               = get_balance(N(eosio.saving)).get_amount(); // DAOBET
-      const uint32_t tot_unpaid_blocks = global_state["total_unpaid_blocks"].as<uint32_t>();
-
-      prod = get_producer_info("defproducera");
-      BOOST_REQUIRE_EQUAL(1, prod["unpaid_blocks"].as<uint32_t>());
-      BOOST_REQUIRE_EQUAL(1, tot_unpaid_blocks);
-      const asset supply  = get_token_supply();
-      const asset balance = get_balance(N(defproducera));
-
-      BOOST_REQUIRE_EQUAL(claim_time, microseconds_since_epoch_of_iso_string( prod["last_claim_time"] ));
+      const asset    supply            = get_token_supply();
 
-      auto usecs_between_fills = claim_time - initial_claim_time;
-      int32_t secs_between_fills = usecs_between_fills/1000000;
+      const int64_t usecs_between_fills = fill_time - initial_fill_time;
+      BOOST_REQUIRE(useconds_per_hour <= usecs_between_fills);
 
       BOOST_REQUIRE_EQUAL(0, initial_dao); // DAOBET
       BOOST_REQUIRE_EQUAL(0, initial_perblock_bucket);
       BOOST_REQUIRE_EQUAL(0, initial_pervote_bucket);
 
-      auto minted = supply.get_amount() - initial_supply.get_amount();
-
-      BOOST_REQUIRE_EQUAL(int64_t( ( initial_supply.get_amount() * double(secs_between_fills) * continuous_rate ) / seconds_per_year ),
-                          supply.get_amount() - initial_supply.get_amount());
+      const int64_t minted = supply.get_amount() - initial_supply.get_amount();
+      BOOST_REQUIRE_EQUAL(int64_t( continuous_rate * initial_supply.get_amount() * usecs_between_fills / useconds_per_year ),
+                          minted);
       ///@{
       ///DAOBET
-      BOOST_REQUIRE_EQUAL(int64_t( ( initial_supply.get_amount() * double(secs_between_fills) * (continuous_rate * 1 / 5.) / seconds_per_year ) ),
-                          dao - initial_dao);
-      BOOST_REQUIRE_EQUAL(int64_t( ( initial_supply.get_amount() * double(secs_between_fills) * (continuous_rate * 4 / 5. * 0.25) / seconds_per_year ) ),
-                          balance.get_amount() - initial_balance.get_amount());
-
-      auto to_dao = int64_t ( initial_supply.get_amount() * double(secs_between_fills) * (continuous_rate * 1 / 5.) / seconds_per_year );
-      auto to_producers = minted - to_dao;
+      const int64_t to_dao = minted / 5;
+      BOOST_REQUIRE_EQUAL(to_dao, dao - initial_dao);
+      const int64_t to_producers = minted - to_dao;
       ///@}
 
       int64_t from_perblock_bucket = to_producers / 4;
       int64_t from_pervote_bucket  = to_producers - from_perblock_bucket;
+      BOOST_REQUIRE_EQUAL(from_perblock_bucket, perblock_bucket);
+      BOOST_REQUIRE_EQUAL(from_pervote_bucket, pervote_bucket);
 
+      prod = get_producer_info("defproducera");
+      const uint32_t unpaid_blocks = prod["unpaid_blocks"].as<uint32_t>();
+      BOOST_REQUIRE_GT(unpaid_blocks, 1);
+      BOOST_REQUIRE_EQUAL(global_state["total_unpaid_blocks"].as<uint32_t>(), unpaid_blocks);
+
+      const asset initial_balance = get_balance(N(defproducera));
+
+      BOOST_REQUIRE_EQUAL(success(), push_action(N(defproducera), N(claimrewards), mvo()("owner", "defproducera")));
+
+      prod = get_producer_info("defproducera");
+      BOOST_REQUIRE_EQUAL(1, prod["unpaid_blocks"].as<uint32_t>());
+      BOOST_REQUIRE_EQUAL(1, get_global_state()["total_unpaid_blocks"].as<uint32_t>());
+      BOOST_REQUIRE_EQUAL(supply, get_token_supply());
+      const asset balance = get_balance(N(defproducera));
 
       if (from_pervote_bucket >= 100 * 10000) {
          BOOST_REQUIRE_EQUAL(from_perblock_bucket + from_pervote_bucket, balance.get_amount() - initial_balance.get_amount());
-         BOOST_REQUIRE_EQUAL(0, pervote_bucket);
+         BOOST_REQUIRE_EQUAL(0, get_global_state()["pervote_bucket"].as<int64_t>());
       } else {
          BOOST_REQUIRE_EQUAL(from_perblock_bucket, balance.get_amount() - initial_balance.get_amount());
-         BOOST_REQUIRE_EQUAL(from_pervote_bucket, pervote_bucket);
+         BOOST_REQUIRE_EQUAL(from_pervote_bucket, get_global_state()["pervote_bucket"].as<int64_t>());
       }
    }
 
@@ -1471,6 +1990,13 @@ BOOST_FIXTURE_TEST_CASE(producer_pay, eosio_system_tester, * boost::unit_test::t
                           push_action(N(defproducera), N(claimrewards), mvo()("owner", "defproducera")));
    }
 
+   const auto     fill_global_state = get_global_state();
+   const uint64_t initial_fill_time = microseconds_since_epoch_of_iso_string( fill_global_state["last_pervote_bucket_fill"] );
+   const asset    initial_supply    = get_token_supply();
+   const int64_t  initial_dao       = get_balance(N(eosio.saving)).get_amount(); // DAOBET
+   const double   continuous_rate   = get_continuous_rate(get_target_emission_rate_per_year(
+      1.0 * fill_global_state["total_activated_stake"].as<int64_t>() / initial_supply.get_amount()));
+
    // defproducera waits for 23 hours and 55 minutes, can't claim rewards yet
    {
       produce_block(fc::seconds(23 * 3600 + 55 * 60));
@@ -1481,12 +2007,14 @@ BOOST_FIXTURE_TEST_CASE(producer_pay, eosio_system_tester, * boost::unit_test::t
    // wait 5 more minutes, defproducera can now claim rewards again
    {
       produce_block(fc::seconds(5 * 60));
+      BOOST_REQUIRE_EQUAL(success(), push_action(N(defproducera), N(fillrewards), mvo()));
+      BOOST_REQUIRE_EQUAL(wasm_assert_msg("no accrued rewards to issue"),
+                          push_action(N(defproducera), N(fillrewards), mvo()));
 
       const auto     initial_global_state      = get_global_state();
-      const uint64_t initial_claim_time        = microseconds_since_epoch_of_iso_string( initial_global_state["last_pervote_bucket_fill"] );
+      const uint64_t fill_time                 = microseconds_since_epoch_of_iso_string( initial_global_state["last_pervote_bucket_fill"] );
       const int64_t  initial_pervote_bucket    = initial_global_state["pervote_bucket"].as<int64_t>();
       const int64_t  initial_perblock_bucket   = initial_global_state["perblock_bucket"].as<int64_t>();
-      const int64_t  initial_dao               = get_balance(N(eosio.saving)).get_amount(); // DAOBET
       const uint32_t initial_tot_unpaid_blocks = initial_global_state["total_unpaid_blocks"].as<uint32_t>();
       const double   initial_tot_vote_weight   = initial_global_state["total_producer_vote_weight"].as<double>();
 
@@ -1498,49 +2026,42 @@ BOOST_FIXTURE_TEST_CASE(producer_pay, eosio_system_tester, * boost::unit_test::t
       BOOST_TEST(initial_tot_vote_weight, prod["total_votes"].as<double>());
       BOOST_REQUIRE(0 < microseconds_since_epoch_of_iso_string( prod["last_claim_time"] ));
 
-      BOOST_REQUIRE_EQUAL(initial_tot_unpaid_blocks, unpaid_blocks);
+      // the inflation was accrued by the first onblock after the interval, that is 23 hours and 55 minutes ago
+      const asset supply = get_token_supply();
+      auto usecs_between_fills = fill_time - initial_fill_time;
+      auto to_dao = get_balance(N(eosio.saving)).get_amount() - initial_dao;
+
+      ///@{
+      ///DAOBET
+      BOOST_REQUIRE_EQUAL(int64_t( continuous_rate * initial_supply.get_amount() * int64_t(usecs_between_fills) / useconds_per_year ),
+                          supply.get_amount() - initial_supply.get_amount());
+      BOOST_REQUIRE_EQUAL( (supply.get_amount() - initial_supply.get_amount()) / 5,
+                          to_dao);
+
+      int64_t to_producer        = supply.get_amount() - initial_supply.get_amount() - to_dao;
+      ///@}
+      int64_t to_perblock_bucket = to_producer / 4;
+      BOOST_REQUIRE_EQUAL(to_perblock_bucket, initial_perblock_bucket);
 
-      const asset initial_supply  = get_token_supply();
       const asset initial_balance = get_balance(N(defproducera));
-      const double emission_rate = get_target_emission_rate_per_year(1.0 * initial_global_state["total_activated_stake"].as<int64_t>() / initial_supply.get_amount());
-      const double continuous_rate = get_continuous_rate(emission_rate);
 
       BOOST_REQUIRE_EQUAL(success(), push_action(N(defproducera), N(claimrewards), mvo()("owner", "defproducera")));
 
-      const auto global_state          = get_global_state();
-      const uint64_t claim_time        = microseconds_since_epoch_of_iso_string( global_state["last_pervote_bucket_fill"] );
+      const auto     global_state      = get_global_state();
       const int64_t  pervote_bucket    = global_state["pervote_bucket"].as<int64_t>();
-      const int64_t  perblock_bucket   = global_state["perblock_bucket"].as<int64_t>();
-      const int64_t  dao               = get_balance(N(eosio.saving)).get_amount(); // DAOBET
       const uint32_t tot_unpaid_blocks = global_state["total_unpaid_blocks"].as<uint32_t>();
 
       prod = get_producer_info("defproducera");
       BOOST_REQUIRE_EQUAL(1, prod["unpaid_blocks"].as<uint32_t>());
       BOOST_REQUIRE_EQUAL(1, tot_unpaid_blocks);
-      const asset supply  = get_token_supply();
+      BOOST_REQUIRE_EQUAL(supply, get_token_supply());
       const asset balance = get_balance(N(defproducera));
 
-      BOOST_REQUIRE_EQUAL(claim_time, microseconds_since_epoch_of_iso_string( prod["last_claim_time"] ));
-      auto usecs_between_fills = claim_time - initial_claim_time;
-      auto to_dao = dao - initial_dao;
-
-      ///@{
-      ///DAOBET
-      BOOST_REQUIRE_EQUAL(int64_t( ( double(initial_supply.get_amount()) * double(usecs_between_fills) * continuous_rate / useconds_per_year ) ),
-                          supply.get_amount() - initial_supply.get_amount());
-      BOOST_REQUIRE_EQUAL( (supply.get_amount() - initial_supply.get_amount()) / 5,
-                          to_dao);
-
-      int64_t to_producer        = supply.get_amount() - initial_supply.get_amount() - to_dao;
-      ///@}
-      int64_t to_perblock_bucket = to_producer / 4;
-      int64_t to_pervote_bucket  = to_producer - to_perblock_bucket;
-
-      if (to_pervote_bucket + initial_pervote_bucket >= 100 * 10000) {
-         BOOST_REQUIRE_EQUAL(to_producer + initial_pervote_bucket - pervote_bucket, balance.get_amount() - initial_balance.get_amount());
+      if (initial_pervote_bucket >= 100 * 10000) {
+         BOOST_REQUIRE_EQUAL(initial_perblock_bucket + initial_pervote_bucket - pervote_bucket, balance.get_amount() - initial_balance.get_amount());
       } else {
-         BOOST_REQUIRE_EQUAL(to_perblock_bucket, balance.get_amount() - initial_balance.get_amount());
-         BOOST_REQUIRE_EQUAL(to_pervote_bucket + initial_pervote_bucket, pervote_bucket);
+         BOOST_REQUIRE_EQUAL(initial_perblock_bucket, balance.get_amount() - initial_balance.get_amount());
+         BOOST_REQUIRE_EQUAL(initial_pervote_bucket, pervote_bucket);
       }
    }
 
@@ -1740,6 +2261,8 @@ BOOST_FIXTURE_TEST_CASE(multiple_producer_pay, eosio_system_tester, * boost::uni
       const double continuous_rate = get_continuous_rate(emission_rate);
       ///@}
 
+      // inflation is accrued by the first onblock after the reward fill interval and issued by the claim
+      produce_block(fc::hours(1));
       BOOST_REQUIRE_EQUAL(success(), push_action(prod_name, N(claimrewards), mvo()("owner", prod_name)));
 
       const auto     global_state      = get_global_state();
@@ -2133,7 +2656,7 @@ BOOST_FIXTURE_TEST_CASE(votepay_share_invariant, eosio_system_tester, * boost::u
    produce_block( fc::hours(1) );
 
    BOOST_REQUIRE_EQUAL( success(), push_action(proda, N(claimrewards), mvo()("owner", proda)) );
-   BOOST_TEST_REQUIRE( 0 == get_producer_info2(proda)["votepay_share"].as_double() );
+   BOOST_TEST_REQUIRE( 0 == votepay_fixed_to_double( get_producer_info2(proda)["votepay_share"] ) );
 
    produce_block( fc::hours(24) );
 
@@ -2142,7 +2665,7 @@ BOOST_FIXTURE_TEST_CASE(votepay_share_invariant, eosio_system_tester, * boost::u
    produce_block( fc::hours(24) );
 
    BOOST_REQUIRE_EQUAL( success(), push_action(prodb, N(claimrewards), mvo()("owner", prodb)) );
-   BOOST_TEST_REQUIRE( 0 == get_producer_info2(prodb)["votepay_share"].as_double() );
+   BOOST_TEST_REQUIRE( 0 == votepay_fixed_to_double( get_producer_info2(prodb)["votepay_share"] ) );
 
    produce_block( fc::hours(10) );
 
@@ -2156,15 +2679,15 @@ BOOST_FIXTURE_TEST_CASE(votepay_share_invariant, eosio_system_tester, * boost::u
 
    const auto& info  = get_producer_info(prodb);
    const auto& info2 = get_producer_info2(prodb);
-   const auto& gs2   = get_global_state2();
    const auto& gs3   = get_global_state3();
+   const auto& gs5   = get_global_state5();
 
-   double expected_total_vpay_share = info2["votepay_share"].as_double()
+   double expected_total_vpay_share = votepay_fixed_to_double( info2["votepay_share"] )
                                        + info["total_votes"].as_double()
                                           * ( microseconds_since_epoch_of_iso_string( gs3["last_vpay_state_update"] )
                                                - microseconds_since_epoch_of_iso_string( info2["last_votepay_share_update"] ) ) / 1E6;
 
-   BOOST_TEST_REQUIRE( expected_total_vpay_share == gs2["total_producer_votepay_share"].as_double() );
+   BOOST_TEST_REQUIRE( expected_total_vpay_share == votepay_fixed_to_double( gs5["total_votepay_share"] ) );
 
 } FC_LOG_AND_RETHROW()
 
@@ -2389,11 +2912,12 @@ BOOST_FIXTURE_TEST_CASE(votepay_share_update_order, eosio_system_tester, * boost
    const auto& gs3         = get_global_state3();
    BOOST_REQUIRE_EQUAL( carol_info2["last_votepay_share_update"].as_string(), gs3["last_vpay_state_update"].as_string() );
    BOOST_REQUIRE_EQUAL( emily_info2["last_votepay_share_update"].as_string(), gs3["last_vpay_state_update"].as_string() );
-   BOOST_TEST_REQUIRE( 0  == carol_info2["votepay_share"].as_double() );
-   BOOST_TEST_REQUIRE( 0  == emily_info2["votepay_share"].as_double() );
+   BOOST_TEST_REQUIRE( 0  == votepay_fixed_to_double( carol_info2["votepay_share"] ) );
+   BOOST_TEST_REQUIRE( 0  == votepay_fixed_to_double( emily_info2["votepay_share"] ) );
    BOOST_REQUIRE( 0 < carol_info["total_votes"].as_double() );
    BOOST_TEST_REQUIRE( carol_info["total_votes"].as_double() == emily_info["total_votes"].as_double() );
-   BOOST_TEST_REQUIRE( gs3["total_vpay_share_change_rate"].as_double() == 2 * carol_info["total_votes"].as_double() );
+   BOOST_TEST_REQUIRE( votepay_fixed_to_double( get_global_state5()["total_vpay_share_change_rate"] ) == 2 * carol_info["total_votes"].as_double() );
+   BOOST_REQUIRE_EQUAL( true, get_global_state5()["votepay_fixed_point"].as<bool>() );
 
 } FC_LOG_AND_RETHROW()
 
@@ -2425,7 +2949,7 @@ BOOST_FIXTURE_TEST_CASE(votepay_transition, eosio_system_tester, * boost::unit_t
       for (const auto& p: producer_names) {
          BOOST_REQUIRE_EQUAL( success(), regproducer(p) );
          BOOST_TEST_REQUIRE(0 == get_producer_info(p)["total_votes"].as_double());
-         BOOST_TEST_REQUIRE(0 == get_producer_info2(p)["votepay_share"].as_double());
+         BOOST_TEST_REQUIRE(0 == votepay_fixed_to_double( get_producer_info2(p)["votepay_share"] ));
          BOOST_REQUIRE(0 < microseconds_since_epoch_of_iso_string( get_producer_info2(p)["last_votepay_share_update"] ));
       }
    }
@@ -2667,6 +3191,7 @@ BOOST_FIXTURE_TEST_CASE(producer_onblock_check, eosio_system_tester) try {
       }
       BOOST_REQUIRE_EQUAL(true, all_21_produced);
       BOOST_REQUIRE_EQUAL(true, rest_didnt_produce);
+      produce_block(fc::hours(1));
       BOOST_REQUIRE_EQUAL(success(),
                           push_action(producer_names.front(), N(claimrewards), mvo()("owner", producer_names.front())));
       BOOST_REQUIRE(0 < get_balance(producer_names.front()).get_amount());
@@ -2899,6 +3424,31 @@ BOOST_FIXTURE_TEST_CASE( elect_producers /*_and_parameters*/, eosio_system_teste
    BOOST_REQUIRE_EQUAL( 1, producer_keys.size() );
    BOOST_REQUIRE_EQUAL( name("defproducer1"), producer_keys[0].producer_name );
 
+   // the same schedule is not proposed again
+   const auto schedule_hash = get_global_state5()["last_proposed_schedule_hash"].as_string();
+   BOOST_REQUIRE_NE( std::string(64, '0'), schedule_hash );
+   const auto schedule_version = control->head_block_state()->active_schedule.version;
+   produce_blocks(250);
+   BOOST_REQUIRE_EQUAL( schedule_hash, get_global_state5()["last_proposed_schedule_hash"].as_string() );
+   BOOST_REQUIRE_EQUAL( schedule_version, control->head_block_state()->active_schedule.version );
+   BOOST_REQUIRE_EQUAL( false, get_global_state5()["schedule_candidates_changed"].as<bool>() );
+
+   // changed votes make the schedule to be rebuilt, but the same producers are not proposed again
+   issue_and_transfer( "alice1111111", STRSYM("1.0000"), config::system_account_name );
+   BOOST_REQUIRE_EQUAL( success(), stake( "alice1111111", STRSYM("0.0000"), STRSYM("0.0000"), STRSYM("1.0000") ) );
+   produce_blocks(250);
+   BOOST_REQUIRE_EQUAL( false, get_global_state5()["schedule_candidates_changed"].as<bool>() );
+   BOOST_REQUIRE_EQUAL( schedule_hash, get_global_state5()["last_proposed_schedule_hash"].as_string() );
+   BOOST_REQUIRE_EQUAL( schedule_version, control->head_block_state()->active_schedule.version );
+
+   // after upgrade the active schedule is not proposed again, but it is recorded as the last proposed one
+   forget_last_proposed_schedule();
+   BOOST_REQUIRE_EQUAL( true, get_global_state5()["schedule_candidates_changed"].as<bool>() );
+   produce_blocks(250);
+   BOOST_REQUIRE_EQUAL( false, get_global_state5()["schedule_candidates_changed"].as<bool>() );
+   BOOST_REQUIRE_EQUAL( schedule_hash, get_global_state5()["last_proposed_schedule_hash"].as_string() );
+   BOOST_REQUIRE_EQUAL( schedule_version, control->head_block_state()->active_schedule.version );
+
    //auto config = config_to_variant( control->get_global_properties().configuration );
    //auto prod1_config = testing::filter_fields( config, producer_parameters_example( 1 ) );
    //REQUIRE_EQUAL_OBJECTS(prod1_config, config);
@@ -2962,8 +3512,373 @@ BOOST_FIXTURE_TEST_CASE( elect_producers /*_and_parameters*/, eosio_system_teste
    //REQUIRE_EQUAL_OBJECTS(prod3_config, config);
    */
 
+   // without candidates nothing is proposed, and the schedule is not rebuilt until they change
+   for( const auto& p : { N(defproducer1), N(defproducer2), N(defproducer3) } ) {
+      BOOST_REQUIRE_EQUAL( success(), push_action( p, N(unregprod), mvo()("producer", p) ) );
+   }
+   BOOST_REQUIRE_EQUAL( true, get_global_state5()["schedule_candidates_changed"].as<bool>() );
+   produce_blocks(250);
+   BOOST_REQUIRE_EQUAL( false, get_global_state5()["schedule_candidates_changed"].as<bool>() );
+   BOOST_REQUIRE( producer_keys == control->head_block_state()->active_schedule.producers );
+
+} FC_LOG_AND_RETHROW()
+
+
+BOOST_FIXTURE_TEST_CASE( schedule_candidates, eosio_system_tester ) try {
+   BOOST_REQUIRE_EQUAL( true, get_global_state5()["candidates_synced"].as<bool>() );
+
+   create_accounts_with_resources( { N(defproducer1), N(defproducer2) } );
+   BOOST_REQUIRE_EQUAL( success(), regproducer( "defproducer1" ) );
+   BOOST_REQUIRE_EQUAL( success(), regproducer( "defproducer2" ) );
+
+   // registered producers without votes are not candidates
+   BOOST_REQUIRE_EQUAL( true, get_schedule_candidate( "defproducer1" ).is_null() );
+   BOOST_REQUIRE_EQUAL( true, get_schedule_candidate( "defproducer2" ).is_null() );
+
+   issue_and_transfer( "alice1111111", STRSYM("1000.0000"), config::system_account_name );
+   BOOST_REQUIRE_EQUAL( success(), stake( "alice1111111", STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("500.0000") ) );
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(defproducer1) } ) );
+
+   auto cand = get_schedule_candidate( "defproducer1" );
+   BOOST_REQUIRE_EQUAL( false, cand.is_null() );
+   BOOST_TEST_REQUIRE( get_producer_info( "defproducer1" )["total_votes"].as_double() == cand["total_votes"].as_double() );
+   BOOST_REQUIRE_EQUAL( get_producer_info( "defproducer1" )["producer_key"].as_string(), cand["producer_key"].as_string() );
+   // stake is not tracked, the contract requires no min_producer_activated_stake
+   BOOST_REQUIRE_EQUAL( 0, cand["total_staked"].as<int64_t>() );
+   BOOST_REQUIRE_EQUAL( true, get_schedule_candidate( "defproducer2" ).is_null() );
+
+   // stake changes of the producer account do not touch the candidate
+   BOOST_REQUIRE_EQUAL( success(), stake( "alice1111111", "defproducer1", STRSYM("5.0000"), STRSYM("5.0000"), STRSYM("0.0000") ) );
+   BOOST_REQUIRE_EQUAL( 0, get_schedule_candidate( "defproducer1" )["total_staked"].as<int64_t>() );
+   BOOST_REQUIRE_EQUAL( false, get_schedule_candidate( "defproducer1" ).is_null() );
+
+   // moving votes to another producer
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(defproducer2) } ) );
+   BOOST_REQUIRE_EQUAL( true, get_schedule_candidate( "defproducer1" ).is_null() );
+   BOOST_REQUIRE_EQUAL( false, get_schedule_candidate( "defproducer2" ).is_null() );
+
+   // deactivated producer is not a candidate anymore
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(defproducer2), N(unregprod), mvo()("producer", "defproducer2") ) );
+   BOOST_REQUIRE_EQUAL( true, get_schedule_candidate( "defproducer2" ).is_null() );
+
+   // ... until it registers again
+   BOOST_REQUIRE_EQUAL( success(), regproducer( "defproducer2" ) );
+   BOOST_REQUIRE_EQUAL( false, get_schedule_candidate( "defproducer2" ).is_null() );
+
+   BOOST_REQUIRE_EQUAL( error("missing authority of eosio"),
+                        push_action( N(alice1111111), N(migrate), mvo()("migration", "synccands")("max_rows", 10) ) );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("migration is already completed"),
+                        push_action( config::system_account_name, N(migrate), mvo()("migration", "synccands")("max_rows", 10) ) );
+} FC_LOG_AND_RETHROW()
+
+
+BOOST_FIXTURE_TEST_CASE( contracts_version, eosio_system_tester ) try {
+   // version is stored by init
+   vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name, N(version), N(version) );
+   BOOST_REQUIRE_EQUAL( false, data.empty() );
+   const auto version = abi_ser.binary_to_variant( "version_info", data, abi_serializer_max_time )["version"].as_string();
+   BOOST_REQUIRE_EQUAL( false, version.empty() );
+
+   BOOST_REQUIRE_EQUAL( error("missing authority of eosio"),
+                        push_action( N(alice1111111), N(updtversion), mvo() ) );
+   BOOST_REQUIRE_EQUAL( success(), push_action( config::system_account_name, N(updtversion), mvo() ) );
+   data = get_row_by_account( config::system_account_name, config::system_account_name, N(version), N(version) );
+   BOOST_REQUIRE_EQUAL( version, abi_ser.binary_to_variant( "version_info", data, abi_serializer_max_time )["version"].as_string() );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( core_supply_snapshot, eosio_system_tester ) try {
+   // core symbol and supply are stored by init
+   BOOST_REQUIRE_EQUAL( symbol{CORE_SYM}.to_string(), get_global_state5()["core_symbol"].as<symbol>().to_string() );
+   BOOST_REQUIRE_EQUAL( get_token_supply(), get_global_state5()["core_supply"].as<asset>() );
+
+   // tokens issued and retired outside of the system contract reach the snapshot with the next reward fill
+   cross_15_percent_threshold();
+   produce_blocks(2); // start the presses
+   const asset supply = get_global_state5()["core_supply"].as<asset>();
+   issue( STRSYM("1000.0000") );
+   base_tester::push_action( N(eosio.token), N(retire), config::system_account_name, mutable_variant_object()
+                             ("quantity", STRSYM("300.0000"))
+                             ("memo",     "") );
+   BOOST_REQUIRE_EQUAL( supply, get_global_state5()["core_supply"].as<asset>() );
+   produce_block( fc::hours(1) );
+   BOOST_REQUIRE( supply + STRSYM("700.0000") < get_global_state5()["core_supply"].as<asset>() );
+   // the snapshot already counts the accrued rewards
+   BOOST_REQUIRE( get_token_supply() < get_global_state5()["core_supply"].as<asset>() );
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(fillrewards), mvo() ) );
+   BOOST_REQUIRE_EQUAL( get_token_supply(), get_global_state5()["core_supply"].as<asset>() );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( reward_fill_after_upgrade_without_supply_snapshot, eosio_system_tester ) try {
+   // over 66% of the supply is activated, the emission rate is 10%
+   const asset supply = get_token_supply();
+   BOOST_REQUIRE_EQUAL( success(), regproducer( N(alice1111111) ) );
+   BOOST_REQUIRE_EQUAL( success(), stake_with_transfer( config::system_account_name, N(alice1111111), STRSYM("0.0000"),
+                                                        STRSYM("0.0000"), asset( supply.get_amount() * 69 / 100, supply.get_symbol() ) ) );
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(alice1111111) } ) );
+   produce_blocks(2); // start the presses
+   BOOST_REQUIRE_LT( 0.66, get_global_state5()["activated_share"].as_double() );
+
+   // the first fill after upgrade uses the activated share, not the missing one
+   clear_core_supply_snapshot();
+   produce_block( fc::hours(1) );
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(fillrewards), mvo() ) );
+   const auto gstate5 = get_global_state5();
+   BOOST_REQUIRE_EQUAL( symbol{CORE_SYM}.to_string(), gstate5["core_symbol"].as<symbol>().to_string() );
+   BOOST_REQUIRE_EQUAL( get_token_supply(), gstate5["core_supply"].as<asset>() );
+   BOOST_REQUIRE_LT( 0.66, gstate5["activated_share"].as_double() );
+   BOOST_REQUIRE_EQUAL( 0.1, gstate5["emission_rate"].as_double() );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( activated_share_cache, eosio_system_tester ) try {
+   const auto check_share = [&]() {
+      const auto gstate5 = get_global_state5();
+      const double active_stake = get_global_state()["active_stake"].as<int64_t>();
+      BOOST_REQUIRE_EQUAL( get_activated_share(), gstate5["activated_share_percent"].as<int32_t>() );
+      BOOST_TEST_REQUIRE( active_stake / get_token_supply().get_amount() == gstate5["activated_share"].as_double() );
+   };
+   check_share();
+
+   // active stake changes on voting and on restaking by an active voter
+   transfer( config::system_account_name, "alice1111111", STRSYM("1000.0000") );
+   BOOST_REQUIRE_EQUAL( success(), stake( N(alice1111111), STRSYM("100.0000"), STRSYM("100.0000"), STRSYM("100.0000") ) );
+   BOOST_REQUIRE_EQUAL( success(), regproducer( N(alice1111111) ) );
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(alice1111111) } ) );
+   BOOST_REQUIRE( 0 < get_global_state5()["activated_share"].as_double() );
+   check_share();
+   BOOST_REQUIRE_EQUAL( success(), stake( N(alice1111111), STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("50.0000") ) );
+   check_share();
+
+   // supply changes on issue and retire are picked up by the next reward fill
+   cross_15_percent_threshold();
+   produce_blocks(2); // start the presses
+   issue( STRSYM("1000.0000") );
+   base_tester::push_action( N(eosio.token), N(retire), config::system_account_name, mutable_variant_object()
+                             ("quantity", STRSYM("300.0000"))
+                             ("memo",     "") );
+   produce_block( fc::hours(1) );
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(fillrewards), mvo() ) );
+   check_share();
+
+   // and revoking votes deactivates the stake
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { } ) );
+   check_share();
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( continuous_rate_cache, eosio_system_tester ) try {
+   const auto check_rate = [&]( double expected_emission_rate ) {
+      const auto gstate5 = get_global_state5();
+      BOOST_REQUIRE_EQUAL( expected_emission_rate, gstate5["emission_rate"].as_double() );
+      // bit-identical to the reference formula
+      BOOST_REQUIRE_EQUAL( get_continuous_rate( expected_emission_rate ), gstate5["continuous_rate"].as_double() );
+   };
+
+   cross_15_percent_threshold();
+   produce_blocks(2); // start the presses
+   produce_block( fc::hours(2) );
+   check_rate( 0.2 );
+
+   transfer( config::system_account_name, "alice1111111", STRSYM("130000000.0000"), config::system_account_name );
+   BOOST_REQUIRE_EQUAL( success(), stake( "alice1111111", "alice1111111", STRSYM("1.0000"), STRSYM("1.0000"), STRSYM("120000000.0000") ) );
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(producer1111) } ) );
+   BOOST_REQUIRE( 0.66 <= get_global_state5()["activated_share"].as_double() );
+   // cached rate is refreshed by the next reward fill
+   check_rate( 0.2 );
+   produce_block( fc::hours(2) );
+   check_rate( 0.1 );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( vote_moves_between_nonadjacent_producers, eosio_system_tester ) try {
+   // producers registered between the old and the new vote are not touched
+   const std::vector<account_name> producers = { N(produceraaaa), N(producerbbbb), N(producercccc), N(producerdddd) };
+   setup_producer_accounts( producers );
+   for( const auto& p : producers ) {
+      BOOST_REQUIRE_EQUAL( success(), regproducer( p ) );
+   }
+   transfer( config::system_account_name, "alice1111111", STRSYM("1000.0000") );
+   BOOST_REQUIRE_EQUAL( success(), stake( N(alice1111111), STRSYM("100.0000"), STRSYM("100.0000"), STRSYM("100.0000") ) );
+
+   const auto check_votes = [&]( const account_name& voted ) {
+      for( const auto& p : producers ) {
+         BOOST_TEST_REQUIRE( (p == voted ? stake2votes( STRSYM("100.0000") ) : 0) == get_producer_info( p )["total_votes"].as_double() );
+      }
+   };
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(produceraaaa) } ) );
+   check_votes( N(produceraaaa) );
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(producerdddd) } ) );
+   check_votes( N(producerdddd) );
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(producerbbbb) } ) );
+   check_votes( N(producerbbbb) );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( vote_weight_multiplier, eosio_system_tester ) try {
+   const auto current_week = [&]() {
+      auto now = control->pending_block_time().time_since_epoch().count() / 1000000;
+      return uint32_t( (now - (config::block_timestamp_epoch / 1000)) / (86400 * 7) );
+   };
+
+   transfer( config::system_account_name, "alice1111111", STRSYM("1000.0000") );
+   BOOST_REQUIRE_EQUAL( success(), stake( N(alice1111111), STRSYM("100.0000"), STRSYM("100.0000"), STRSYM("100.0000") ) );
+   BOOST_REQUIRE_EQUAL( success(), regproducer( N(alice1111111) ) );
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(alice1111111) } ) );
+
+   // multiplier is computed once for the current week
+   auto gstate5 = get_global_state5();
+   BOOST_REQUIRE_EQUAL( current_week(), gstate5["vote_weight_week"].as<uint32_t>() );
+   BOOST_TEST_REQUIRE( pow( 2, current_week() / double(52) ) == gstate5["vote_weight_multiplier"].as_double() );
+   BOOST_TEST_REQUIRE( stake2votes( STRSYM("100.0000") ) == get_producer_info( N(alice1111111) )["total_votes"].as_double() );
+
+   // and recomputed when the week changes
+   produce_block( fc::days(7) );
+   produce_blocks(1);
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(alice1111111) } ) );
+   gstate5 = get_global_state5();
+   BOOST_REQUIRE_EQUAL( current_week(), gstate5["vote_weight_week"].as<uint32_t>() );
+   BOOST_TEST_REQUIRE( pow( 2, current_week() / double(52) ) == gstate5["vote_weight_multiplier"].as_double() );
+   BOOST_REQUIRE_EQUAL( stake2votes( STRSYM("100.0000") ), get_voter_info( N(alice1111111) )["last_vote_weight"].as_double() );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( votepay_share_long_interval, eosio_system_tester ) try {
+   const __int128 max_share = __int128( ~(unsigned __int128)0 >> 1 );
+
+   issue_and_transfer( "alice1111111", STRSYM("4000000000.0000"), config::system_account_name );
+   BOOST_REQUIRE_EQUAL( success(), stake( "alice1111111", STRSYM("1.0000"), STRSYM("1.0000"), STRSYM("3999999998.0000") ) );
+   issue_and_transfer( "bob111111111", STRSYM("10.0000"), config::system_account_name );
+   BOOST_REQUIRE_EQUAL( success(), stake( "bob111111111", STRSYM("1.0000"), STRSYM("1.0000"), STRSYM("1.0000") ) );
+   BOOST_REQUIRE_EQUAL( success(), regproducer( N(alice1111111) ) );
+   BOOST_REQUIRE_EQUAL( success(), regproducer( N(bob111111111) ) );
+   BOOST_REQUIRE_EQUAL( success(), vote( N(alice1111111), { N(alice1111111) } ) );
+
+   const __int128 rate  = votepay_fixed( get_global_state5()["total_vpay_share_change_rate"] );
+   const __int128 share = votepay_fixed( get_global_state5()["total_votepay_share"] );
+   const auto last_update = get_global_state3()["last_vpay_state_update"].as<fc::time_point>();
+   BOOST_REQUIRE( 0 < rate );
+
+   // nobody updates vote pay shares long enough for rate * microseconds to exceed int128
+   const int64_t days = int64_t( max_share / rate / (__int128(useconds_per_day)) ) + 7;
+   BOOST_REQUIRE( days < 2 * 365 );
+   produce_block( fc::days(days) );
+   produce_blocks(1);
+   BOOST_REQUIRE_EQUAL( success(), vote( N(bob111111111), { N(bob111111111) } ) );
+
+   const int64_t elapsed = (get_global_state3()["last_vpay_state_update"].as<fc::time_point>() - last_update).count();
+   BOOST_REQUIRE( max_share / rate < elapsed );
+   const __int128 expected = share + rate * (elapsed / 1'000'000) + rate * (elapsed % 1'000'000) / 1'000'000;
+   BOOST_REQUIRE( expected == votepay_fixed( get_global_state5()["total_votepay_share"] ) );
+   BOOST_REQUIRE( rate == votepay_fixed( get_global_state5()["total_vpay_share_change_rate"] ) );
 } FC_LOG_AND_RETHROW()
 
+BOOST_FIXTURE_TEST_CASE( merged_producers, eosio_system_tester ) try {
+   BOOST_REQUIRE_EQUAL( true, get_global_state5()["producers_merged"].as<bool>() );
+
+   // vote pay share is kept in the producers table row
+   BOOST_REQUIRE_EQUAL( success(), regproducer( N(alice1111111) ) );
+   BOOST_REQUIRE_EQUAL( true, get_row_by_account( config::system_account_name, config::system_account_name,
+                                                  N(producers2), N(alice1111111) ).empty() );
+   const auto info = get_producer_info( N(alice1111111) );
+   BOOST_REQUIRE_EQUAL( 0, votepay_fixed_to_double( info["votepay_share"] ) );
+   BOOST_REQUIRE_EQUAL( info["last_claim_time"].as_string(), info["last_votepay_share_update"].as_string() );
+
+   BOOST_REQUIRE_EQUAL( error("missing authority of eosio"),
+                        push_action( N(alice1111111), N(migrate), mvo()("migration", "mergeprods")("max_rows", 10) ) );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("migration is already completed"),
+                        push_action( config::system_account_name, N(migrate), mvo()("migration", "mergeprods")("max_rows", 10) ) );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("unknown migration"),
+                        push_action( config::system_account_name, N(migrate), mvo()("migration", "producers2")("max_rows", 10) ) );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("max_rows should be positive"),
+                        push_action( config::system_account_name, N(migrate), mvo()("migration", "mergeprods")("max_rows", 0) ) );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( recount_proxy, eosio_system_tester ) try {
+   BOOST_REQUIRE_EQUAL( true, get_global_state5()["voters_upgraded"].as<bool>() );
+
+   BOOST_REQUIRE_EQUAL( success(), push_action( N(alice1111111), N(regproxy), mvo()("proxy", "alice1111111")("isproxy", true) ) );
+   for( const auto& delegator : { N(bob111111111), N(carol1111111) } ) {
+      issue_and_transfer( delegator, STRSYM("1000.0000"),  config::system_account_name );
+      BOOST_REQUIRE_EQUAL( success(), stake( delegator, STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("100.0000") ) );
+      BOOST_REQUIRE_EQUAL( success(), vote( delegator, {}, N(alice1111111) ) );
+   }
+   const double proxied_vote_weight = get_voter_info( "alice1111111" )["proxied_vote_weight"].as_double();
+   BOOST_TEST_REQUIRE( 2 * stake2votes( STRSYM("100.0000") ) == proxied_vote_weight );
+
+   BOOST_REQUIRE_EQUAL( error("missing authority of eosio"),
+                        push_action( N(alice1111111), N(recountproxy), mvo()("proxy", "alice1111111")("max_rows", 1) ) );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("account is not a proxy"),
+                        push_action( config::system_account_name, N(recountproxy), mvo()("proxy", "bob111111111")("max_rows", 1) ) );
+
+   // delegators are counted in batches
+   BOOST_REQUIRE_EQUAL( success(),
+                        push_action( config::system_account_name, N(recountproxy), mvo()("proxy", "alice1111111")("max_rows", 1) ) );
+   vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name, N(proxyrecount), N(alice1111111) );
+   BOOST_REQUIRE_EQUAL( false, data.empty() );
+   BOOST_REQUIRE_EQUAL( "carol1111111", abi_ser.binary_to_variant( "proxy_recount", data, abi_serializer_max_time )["cursor"].as_string() );
+
+   BOOST_REQUIRE_EQUAL( success(),
+                        push_action( config::system_account_name, N(recountproxy), mvo()("proxy", "alice1111111")("max_rows", 1) ) );
+   BOOST_REQUIRE_EQUAL( true, get_row_by_account( config::system_account_name, config::system_account_name,
+                                                  N(proxyrecount), N(alice1111111) ).empty() );
+   BOOST_TEST_REQUIRE( proxied_vote_weight == get_voter_info( "alice1111111" )["proxied_vote_weight"].as_double() );
+
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("migration is already completed"),
+                        push_action( config::system_account_name, N(migrate), mvo()("migration", "packvoters")("max_rows", 10) ) );
+} FC_LOG_AND_RETHROW()
+
+BOOST_FIXTURE_TEST_CASE( compact_voter_rows, eosio_system_tester ) try {
+   const std::vector<account_name> voters = { N(alice1111111), N(bob111111111), N(carol1111111) };
+   for( const auto& v : voters ) {
+      issue_and_transfer( v, STRSYM("1000.0000"),  config::system_account_name );
+      BOOST_REQUIRE_EQUAL( success(), stake( v, STRSYM("10.0000"), STRSYM("10.0000"), STRSYM("100.0000") ) );
+   }
+   for( const auto& p : { N(alice1111111), N(carol1111111) } ) {
+      BOOST_REQUIRE_EQUAL( success(), push_action( p, N(regproxy), mvo()("proxy", p)("isproxy", true) ) );
+   }
+   BOOST_REQUIRE_EQUAL( success(), vote( N(bob111111111), {}, N(alice1111111) ) );
+
+   // compact rows stay in the voters table and end with flags1
+   auto row_size = [&]( const account_name& v ) {
+      return get_row_by_account( config::system_account_name, config::system_account_name, N(voters), v ).size();
+   };
+   const size_t compact_size = 8 + 8 + 1 + 8 + 8 + 8 + 1 + 4;
+   for( const auto& v : voters ) {
+      BOOST_REQUIRE_EQUAL( compact_size, row_size( v ) );
+      BOOST_REQUIRE_EQUAL( false, get_voter_info( v ).get_object().contains( "reserved2" ) );
+   }
+
+   // rows stored by a previous version still decode with the voters table abi
+   for( const auto& v : voters ) {
+      make_legacy_voter_row( v );
+   }
+   BOOST_REQUIRE_EQUAL( compact_size + 4 + 16 + 1, row_size( N(bob111111111) ) );
+   BOOST_REQUIRE_EQUAL( true, get_voter_info( N(bob111111111) )["has_voted"].as<bool>() );
+   REQUIRE_MATCHING_OBJECT( voter( "bob111111111", STRSYM("100.0000") )( "proxy", "alice1111111" ),
+                            get_voter_info( N(bob111111111) ) );
+   BOOST_REQUIRE_EQUAL( false, get_global_state5()["voters_upgraded"].as<bool>() );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("voters are not upgraded yet"),
+                        push_action( config::system_account_name, N(recountproxy), mvo()("proxy", "alice1111111")("max_rows", 1) ) );
+
+   // touched voters are upgraded
+   BOOST_REQUIRE_EQUAL( success(), vote( N(bob111111111), {}, N(carol1111111) ) );
+   for( const auto& v : voters ) {
+      BOOST_REQUIRE_EQUAL( compact_size, row_size( v ) );
+   }
+
+   // the rest are upgraded by the migration
+   make_legacy_voter_row( N(alice1111111) );
+   BOOST_REQUIRE_EQUAL( success(),
+                        push_action( config::system_account_name, N(migrate), mvo()("migration", "packvoters")("max_rows", 100) ) );
+   BOOST_REQUIRE_EQUAL( true, get_global_state5()["voters_upgraded"].as<bool>() );
+   for( const auto& v : voters ) {
+      BOOST_REQUIRE_EQUAL( compact_size, row_size( v ) );
+   }
+   REQUIRE_MATCHING_OBJECT( proxy( "alice1111111" )( "staked", STRSYM("100.0000").get_amount() ),
+                            get_voter_info( N(alice1111111) ) );
+
+   // the upgraded delegator is found through `byproxy` index of its new proxy
+   const double proxied_vote_weight = get_voter_info( N(carol1111111) )["proxied_vote_weight"].as_double();
+   BOOST_TEST_REQUIRE( stake2votes( STRSYM("100.0000") ) == proxied_vote_weight );
+   BOOST_REQUIRE_EQUAL( success(),
+                        push_action( config::system_account_name, N(recountproxy), mvo()("proxy", "carol1111111")("max_rows", 10) ) );
+   BOOST_TEST_REQUIRE( proxied_vote_weight == get_voter_info( N(carol1111111) )["proxied_vote_weight"].as_double() );
+} FC_LOG_AND_RETHROW()
 
 BOOST_FIXTURE_TEST_CASE( buyname, eosio_system_tester ) try {
    create_accounts_with_resources( { N(dan), N(sam) } );
@@ -3117,60 +4032,96 @@ BOOST_FIXTURE_TEST_CASE( multiple_namebids, eosio_system_tester ) try {
    produce_blocks( 10 );
    BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefd), N(david) ),
                             fc::exception, fc_assert_exception_message_is( not_closed_message ) );
-   // it's been 14 days, auction for prefd has been closed
+   // it's been 14 days, all auctions without bids for a day have been closed
    produce_block( fc::days(12) );
    create_account_with_resources( N(prefd), N(david) );
    produce_blocks(2);
-   produce_block( fc::hours(23) );
-   // auctions for prefa, prefb, prefc, prefe haven't been closed
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefa), N(bob) ),
-                            fc::exception, fc_assert_exception_message_is( not_closed_message ) );
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefb), N(alice) ),
-                            fc::exception, fc_assert_exception_message_is( not_closed_message ) );
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefc), N(bob) ),
-                            fc::exception, fc_assert_exception_message_is( not_closed_message ) );
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefe), N(eve) ),
-                            fc::exception, fc_assert_exception_message_is( not_closed_message ) );
+   for( const auto& n : { N(prefa), N(prefb), N(prefc), N(prefe) } ) {
+      BOOST_REQUIRE_LT( get_name_bid( n )["high_bid"].as<int64_t>(), 0 );
+   }
+   BOOST_REQUIRE_EQUAL( error("assertion failure with message: this auction has already closed"),
+                        bidname( "eve",  "prefb", STRSYM("2.1880") ) );
+   // only highest bidder can claim
+   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefb), N(bob) ),
+                            eosio_assert_message_exception, eosio_assert_message_is( "only highest bidder can claim" ) );
+   create_account_with_resources( N(prefb), N(alice) );
    // attemp to create account with no bid
    BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefg), N(alice) ),
                             fc::exception, fc_assert_exception_message_is( "no active bid for name" ) );
-   // changing highest bid pushes auction closing time by 24 hours
-   BOOST_REQUIRE_EQUAL( success(),
-                        bidname( "eve",  "prefb", STRSYM("2.1880") ) );
 
+   // new auction is closed a day after its last bid
+   BOOST_REQUIRE_EQUAL( success(),
+                        bidname( "carl", "prefg", STRSYM("1.0000") ) );
    produce_block( fc::hours(22) );
    produce_blocks(2);
-
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefb), N(eve) ),
+   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefg), N(carl) ),
                             fc::exception, fc_assert_exception_message_is( not_closed_message ) );
-   // but changing a bid that is not the highest does not push closing time
+   // changing highest bid pushes auction closing time by 24 hours
    BOOST_REQUIRE_EQUAL( success(),
-                        bidname( "carl", "prefe", STRSYM("2.0980") ) );
+                        bidname( "eve",  "prefg", STRSYM("1.1001") ) );
+   produce_block( fc::hours(22) );
+   produce_blocks(2);
+   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefg), N(eve) ),
+                            fc::exception, fc_assert_exception_message_is( not_closed_message ) );
    produce_block( fc::hours(2) );
    produce_blocks(2);
-   // bid for prefb has closed, only highest bidder can claim
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefb), N(alice) ),
+   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefg), N(carl) ),
                             eosio_assert_message_exception, eosio_assert_message_is( "only highest bidder can claim" ) );
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefb), N(carl) ),
-                            eosio_assert_message_exception, eosio_assert_message_is( "only highest bidder can claim" ) );
-   create_account_with_resources( N(prefb), N(eve) );
+   create_account_with_resources( N(prefg), N(eve) );
 
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefe), N(carl) ),
-                            fc::exception, fc_assert_exception_message_is( not_closed_message ) );
-   produce_block();
-   produce_block( fc::hours(24) );
-   // by now bid for prefe has closed
-   create_account_with_resources( N(prefe), N(carl) );
+   create_account_with_resources( N(prefe), N(eve) );
    // prefe can now create *.prefe
    BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(xyz.prefe), N(carl) ),
                             fc::exception, fc_assert_exception_message_is("only suffix may create this account") );
    transfer( config::system_account_name, N(prefe), STRSYM("10000.0000") );
    create_account_with_resources( N(xyz.prefe), N(prefe) );
 
-   // other auctions haven't closed
-   BOOST_REQUIRE_EXCEPTION( create_account_with_resources( N(prefa), N(bob) ),
-                            fc::exception, fc_assert_exception_message_is( not_closed_message ) );
+   // closed auctions wait for their winners
+   create_account_with_resources( N(prefa), N(bob) );
+   create_account_with_resources( N(prefc), N(bob) );
 
+   BOOST_REQUIRE_EQUAL( error("missing authority of eosio"),
+                        push_action( N(alice), N(migrate), mvo()("migration", "reindexbids")("max_rows", 10) ) );
+   BOOST_REQUIRE_EQUAL( wasm_assert_msg("migration is already completed"),
+                        push_action( config::system_account_name, N(migrate), mvo()("migration", "reindexbids")("max_rows", 10) ) );
+} FC_LOG_AND_RETHROW()
+
+
+BOOST_FIXTURE_TEST_CASE( namebids_closed_per_block_cap, eosio_system_tester ) try {
+   const std::vector<account_name> names = { N(prefa), N(prefb), N(prefc), N(prefd), N(prefe), N(preff),
+                                             N(prefg), N(prefh), N(prefi), N(prefj), N(prefk), N(prefl) };
+   constexpr size_t max_name_closes_per_block = 10;
+   BOOST_REQUIRE_GT( names.size(), max_name_closes_per_block );
+
+   create_accounts_with_resources( { N(bob) } );
+   transfer( config::system_account_name, N(bob), STRSYM( "10000.0000" ) );
+   for( const auto& n : names ) {
+      BOOST_REQUIRE_EQUAL( success(), bidname( "bob", n, STRSYM("1.0000") ) );
+   }
+   cross_15_percent_threshold();
+
+   auto closed_count = [&]() {
+      return size_t( std::count_if( names.begin(), names.end(), [&]( const account_name& n ) {
+         return get_name_bid( n )["high_bid"].as<int64_t>() < 0;
+      }) );
+   };
+   // names are not sold in the first 14 days after activation
+   produce_block( fc::days(13) );
+   produce_blocks(2);
+   BOOST_REQUIRE_EQUAL( 0u, closed_count() );
+
+   // a single schedule update pass closes at most max_name_closes_per_block auctions, oldest first
+   produce_block( fc::days(1) );
+   produce_blocks(2);
+   BOOST_REQUIRE_EQUAL( max_name_closes_per_block, closed_count() );
+   for( size_t i = 0; i < max_name_closes_per_block; ++i ) {
+      BOOST_REQUIRE_LT( get_name_bid( names[i] )["high_bid"].as<int64_t>(), 0 );
+   }
+
+   // the next pass closes the rest
+   produce_block( fc::minutes(2) );
+   produce_blocks(2);
+   BOOST_REQUIRE_EQUAL( names.size(), closed_count() );
 } FC_LOG_AND_RETHROW()
 
 
@@ -3431,37 +4382,49 @@ BOOST_FIXTURE_TEST_CASE( ram_inflation, eosio_system_tester ) try {
    uint16_t rate = 1000;
    BOOST_REQUIRE_EQUAL( success(), push_action( config::system_account_name, N(setramrate), mvo()("bytes_per_block", rate) ) );
    BOOST_REQUIRE_EQUAL( rate, get_global_state2()["new_ram_per_block"].as<uint16_t>() );
-   // last time update_ram_supply called is in buyram, num of blocks since then to
-   // the block that includes the setramrate action is 1 + 3 = 4.
-   // However, those 4 blocks were accumulating at a rate of 0, so the max_ram_size should not have changed.
+   // blocks before the one that includes the setramrate action were accumulating at a rate of 0,
+   // so the max_ram_size should not have changed.
    BOOST_REQUIRE_EQUAL( init_max_ram_size, get_global_state()["max_ram_size"].as_uint64() );
-   // But with additional blocks, it should start accumulating at the new rate.
+
+   // RAM actions do not change the supply, onblock adds it once every ram_increase_interval blocks
+   const uint32_t ram_increase_interval = 120;
    uint64_t cur_ram_size = get_global_state()["max_ram_size"].as_uint64();
-   produce_blocks(10);
+   produce_blocks( ram_increase_interval - 4 );
    BOOST_REQUIRE_EQUAL( success(), buyram( "alice1111111", "alice1111111", STRSYM("100.0000") ) );
-   BOOST_REQUIRE_EQUAL( cur_ram_size + 11 * rate, get_global_state()["max_ram_size"].as_uint64() );
-   cur_ram_size = get_global_state()["max_ram_size"].as_uint64();
-   produce_blocks(5);
-   BOOST_REQUIRE_EQUAL( cur_ram_size, get_global_state()["max_ram_size"].as_uint64() );
    BOOST_REQUIRE_EQUAL( success(), sellram( "alice1111111", 100 ) );
-   BOOST_REQUIRE_EQUAL( cur_ram_size + 6 * rate, get_global_state()["max_ram_size"].as_uint64() );
-   cur_ram_size = get_global_state()["max_ram_size"].as_uint64();
+   BOOST_REQUIRE_EQUAL( cur_ram_size, get_global_state()["max_ram_size"].as_uint64() );
+   const auto ram_balance = [this]() {
+      vector<char> data = get_row_by_account( config::system_account_name, config::system_account_name,
+                                              N(rammarket), symbol{SY(4,RAMCORE)}.value() );
+      return abi_ser.binary_to_variant( "exchange_state", data, abi_serializer_max_time )["base"].as<connector>().balance.get_amount();
+   };
+   const int64_t cur_ram_balance = ram_balance();
    produce_blocks();
+   BOOST_REQUIRE_EQUAL( cur_ram_size + ram_increase_interval * rate, get_global_state()["max_ram_size"].as_uint64() );
+   BOOST_REQUIRE_EQUAL( cur_ram_balance + ram_increase_interval * rate, ram_balance() );
+   cur_ram_size = get_global_state()["max_ram_size"].as_uint64();
    BOOST_REQUIRE_EQUAL( success(), buyrambytes( "alice1111111", "alice1111111", 100 ) );
-   BOOST_REQUIRE_EQUAL( cur_ram_size + 2 * rate, get_global_state()["max_ram_size"].as_uint64() );
+   BOOST_REQUIRE_EQUAL( cur_ram_size, get_global_state()["max_ram_size"].as_uint64() );
 
    BOOST_REQUIRE_EQUAL( error("missing authority of eosio"),
                         push_action( "alice1111111", N(setramrate), mvo()("bytes_per_block", rate) ) );
 
-   cur_ram_size = get_global_state()["max_ram_size"].as_uint64();
+   // changing the rate adds RAM allocated at the old rate since the last increase
    produce_blocks(10);
    uint16_t old_rate = rate;
    rate = 5000;
    BOOST_REQUIRE_EQUAL( success(), push_action( config::system_account_name, N(setramrate), mvo()("bytes_per_block", rate) ) );
    BOOST_REQUIRE_EQUAL( cur_ram_size + 11 * old_rate, get_global_state()["max_ram_size"].as_uint64() );
-   produce_blocks(5);
-   BOOST_REQUIRE_EQUAL( success(), buyrambytes( "alice1111111", "alice1111111", 100 ) );
-   BOOST_REQUIRE_EQUAL( cur_ram_size + 11 * old_rate + 6 * rate, get_global_state()["max_ram_size"].as_uint64() );
+   produce_blocks( ram_increase_interval - 2 );
+   BOOST_REQUIRE_EQUAL( cur_ram_size + 11 * old_rate, get_global_state()["max_ram_size"].as_uint64() );
+   produce_blocks();
+   BOOST_REQUIRE_EQUAL( cur_ram_size + 11 * old_rate + ram_increase_interval * rate, get_global_state()["max_ram_size"].as_uint64() );
+
+   // no increases while the rate is 0
+   BOOST_REQUIRE_EQUAL( success(), push_action( config::system_account_name, N(setramrate), mvo()("bytes_per_block", 0) ) );
+   cur_ram_size = get_global_state()["max_ram_size"].as_uint64();
+   produce_blocks( 2 * ram_increase_interval );
+   BOOST_REQUIRE_EQUAL( cur_ram_size, get_global_state()["max_ram_size"].as_uint64() );
 
 } FC_LOG_AND_RETHROW()
 